@@ -68,6 +68,14 @@
 #define SY1  0x4000
 #define SY2  0x2000
 
+/*
+ * Query attribute for the DNS64 AAAA to A restart.  It belongs next to
+ * NS_QUERYATTR_DNS64PTR in <named/client.h>, clear of the bits used there.
+ */
+#ifndef NS_QUERYATTR_DNS64A
+#define NS_QUERYATTR_DNS64A	0x10000
+#endif
+
 /*% Partial answer? */
 #define PARTIALANSWER(c)	(((c)->query.attributes & \
 				  NS_QUERYATTR_PARTIALANSWER) != 0)
@@ -99,11 +107,15 @@
 #define SECURE(c)		(((c)->query.attributes & \
 				  NS_QUERYATTR_SECURE) != 0)
 
+/*% DNS64 restart with A? */
+#define DNS64A(c)		(((c)->query.attributes & \
+				  NS_QUERYATTR_DNS64A) != 0)
+
 /*% No QNAME Proof? */
 #define NOQNAME(r)		(((r)->attributes & \
 				  DNS_RDATASETATTR_NOQNAME) != 0)
 
-#if 0
+#ifdef WANT_QUERYTRACE
 #define CTRACE(m)       isc_log_write(ns_g_lctx, \
 				      NS_LOGCATEGORY_CLIENT, \
 				      NS_LOGMODULE_QUERY, \
@@ -136,6 +148,10 @@ void dns64_flag(unsigned int pre64_len, isc_uint16_t *flag);
 static isc_result_t
 query_find(ns_client_t *client, dns_fetchevent_t *event, dns_rdatatype_t qtype);
 
+static isc_result_t
+query_dns64_synth_rdataset(ns_client_t *client, dns_rdataset_t *rdataset,
+			   dns_rdataset_t **srdatasetp);
+
 static isc_boolean_t
 validate(ns_client_t *client, dns_db_t *db, dns_name_t *name,
 	 dns_rdataset_t *rdataset, dns_rdataset_t *sigrdataset);
@@ -243,7 +259,13 @@ add_dns64_opt(ns_client_t *client)
 
   rdatalist->ttl = (client->extflags & DNS_MESSAGEEXTFLAG_REPLYPRESERVE);
 
+  /*
+   * Built with -DDNS64_NO_SY the option carries no SY bits, so that
+   * clients have to fall back to the heuristic.
+   */
+#ifndef DNS64_NO_SY
   dns64_flag(view->dns64_prefixlen, &flag);
+#endif
 
 // EDNS0 SY bits, 4B header + 2B data
 
@@ -439,7 +461,8 @@ query_reset(ns_client_t *client, isc_boolean_t everything) {
 
 	if (client->query.restarts > 0) {
 		/*
-		 * client->query.qname was dynamically allocated.
+		 * client->query.qname is a temporary name, with dynamically
+		 * allocated data unless it is the DNS64 copy of the question.
 		 */
 		dns_message_puttempname(client->message,
 					&client->query.qname);
@@ -1177,6 +1200,64 @@ query_isduplicate(ns_client_t *client, dns_name_t *name,
 	return (ISC_FALSE);
 }
 
+/*
+ * DNS64: the AAAA lookup result implied by an additional cache entry
+ * for 'cfname'.  Such entries are only made once the lookups are
+ * complete, so a missing AAAA RRset means the zone has none.
+ */
+static isc_result_t
+query_dns64_cachedaaaa(dns_name_t *cfname) {
+	dns_rdataset_t *rdataset;
+
+	for (rdataset = ISC_LIST_HEAD(cfname->list);
+	     rdataset != NULL;
+	     rdataset = ISC_LIST_NEXT(rdataset, link)) {
+		if (rdataset->type == dns_rdatatype_aaaa)
+			return (ISC_R_SUCCESS);
+	}
+	return (ISC_R_NOTFOUND);
+}
+
+/*
+ * DNS64: 'fname' is about to go to the additional section.  If it has
+ * an A RRset and the name has no AAAA RRset, add an AAAA RRset
+ * synthesized from the A RRset, so that IPv6-only clients need not ask
+ * for it.  'db' is the database the data came from and 'aaaaresult'
+ * the result of looking up the AAAA RRset there, ISC_R_FAILURE if it
+ * was not looked up.  Zone data has no AAAA RRset on ISC_R_NOTFOUND,
+ * a cache only with a negative cache entry.  A native AAAA RRset left
+ * out as a duplicate of the answer is not replaced.
+ */
+static void
+query_dns64_addadditional(ns_client_t *client, dns_db_t *db,
+			  dns_name_t *fname, isc_result_t aaaaresult)
+{
+	dns_rdataset_t *rdataset, *arset, *srdataset;
+
+	if (client->view->dns64_prefixlen > 96 ||
+	    (client->message->flags & DNS_MESSAGEFLAG_CD) != 0)
+		return;
+	if (aaaaresult != DNS_R_NCACHENXRRSET &&
+	    (aaaaresult != ISC_R_NOTFOUND || dns_db_iscache(db)))
+		return;
+
+	arset = NULL;
+	for (rdataset = ISC_LIST_HEAD(fname->list);
+	     rdataset != NULL;
+	     rdataset = ISC_LIST_NEXT(rdataset, link)) {
+		if (rdataset->type == dns_rdatatype_a)
+			arset = rdataset;
+	}
+	if (arset == NULL)
+		return;
+
+	CTRACE("query_dns64_addadditional");
+	srdataset = NULL;
+	if (query_dns64_synth_rdataset(client, arset, &srdataset) ==
+	    ISC_R_SUCCESS)
+		ISC_LIST_APPEND(fname->list, srdataset, link);
+}
+
 static isc_result_t
 query_addadditional(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	ns_client_t *client = arg;
@@ -1189,6 +1270,7 @@ query_addadditional(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	isc_buffer_t b;
 	dns_dbversion_t *version;
 	isc_boolean_t added_something, need_addname;
+	isc_result_t aaaaresult;
 	dns_zone_t *zone;
 	dns_rdatatype_t type;
 
@@ -1213,6 +1295,7 @@ query_addadditional(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	node = NULL;
 	added_something = ISC_FALSE;
 	need_addname = ISC_FALSE;
+	aaaaresult = ISC_R_FAILURE;
 	zone = NULL;
 
 	/*
@@ -1461,6 +1544,7 @@ query_addadditional(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 					     dns_rdatatype_aaaa, 0,
 					     client->now, rdataset,
 					     sigrdataset);
+		aaaaresult = result;
 		if (result == DNS_R_NCACHENXDOMAIN)
 			goto addname;
 		if (result == DNS_R_NCACHENXRRSET) {
@@ -1499,6 +1583,9 @@ query_addadditional(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	if (!added_something)
 		goto cleanup;
 
+	if (qtype == dns_rdatatype_a)
+		query_dns64_addadditional(client, db, fname, aaaaresult);
+
 	/*
 	 * We may have added our rdatasets to an existing name, if so, then
 	 * need_addname will be ISC_FALSE.  Whether we used an existing name
@@ -1617,6 +1704,7 @@ query_addadditional2(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	dns_dbversion_t *version, *cversion;
 	isc_boolean_t added_something, need_addname, needadditionalcache;
 	isc_boolean_t need_sigrrset;
+	isc_result_t aaaaresult;
 	dns_zone_t *zone;
 	dns_rdatatype_t type;
 	dns_rdatasetadditional_t additionaltype;
@@ -1651,6 +1739,7 @@ query_addadditional2(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	need_addname = ISC_FALSE;
 	zone = NULL;
 	needadditionalcache = ISC_FALSE;
+	aaaaresult = ISC_R_FAILURE;
 	additionaltype = dns_rdatasetadditional_fromauth;
 	dns_name_init(&cfname, NULL);
 
@@ -1729,6 +1818,7 @@ query_addadditional2(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	node = cnode;
 	dns_name_clone(&cfname, fname);
 	query_keepname(client, fname, dbuf);
+	aaaaresult = query_dns64_cachedaaaa(&cfname);
 	goto foundcache;
 
 	/*
@@ -1851,6 +1941,7 @@ query_addadditional2(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	node = cnode;
 	dns_name_clone(&cfname, fname);
 	query_keepname(client, fname, dbuf);
+	aaaaresult = query_dns64_cachedaaaa(&cfname);
 	goto foundcache;
 
  findglue:
@@ -1951,6 +2042,7 @@ query_addadditional2(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 			dns_rdataset_disassociate(sigrdataset);
 		result = ISC_R_NOTFOUND;
 	}
+	aaaaresult = result;
 	if (result == ISC_R_SUCCESS) {
 		ISC_LIST_APPEND(cfname.list, rdataset, link);
 		rdataset = NULL;
@@ -2028,6 +2120,8 @@ query_addadditional2(void *arg, dns_name_t *name, dns_rdatatype_t qtype) {
 	if (!added_something)
 		goto cleanup;
 
+	query_dns64_addadditional(client, db, fname, aaaaresult);
+
 	/*
 	 * We may have added our rdatasets to an existing name, if so, then
 	 * need_addname will be ISC_FALSE.  Whether we used an existing name
@@ -2398,19 +2492,105 @@ synthesize_aaaa(const isc_uint8_t prefix[16], unsigned int prefixlen,
 	aaaa[prefixlen/8+2] |= a[2] >> (0+prefixlen%8);
 	aaaa[prefixlen/8+3] |= a[2] << (8-prefixlen%8);
 	aaaa[prefixlen/8+3] |= a[3] >> (0+prefixlen%8);
-	if (prefixlen/8/4 < 16)  /* <-- my beautiful symmetry is destroyed! */
+	if (prefixlen/8+4 < 16)  /* <-- my beautiful symmetry is destroyed! */
 	aaaa[prefixlen/8+4] |= a[3] << (8-prefixlen%8);
 }
 
+/*
+ * Synthesize an AAAA RRset from the A RRset 'rdataset' and return it in
+ * '*srdatasetp'.
+ */
+static isc_result_t
+query_dns64_synth_rdataset(ns_client_t *client, dns_rdataset_t *rdataset,
+			   dns_rdataset_t **srdatasetp)
+{
+	dns_rdataset_t *srdataset;
+	dns_rdata_t *srdata;
+	dns_rdatalist_t *srdatalist;
+	isc_buffer_t *buffer;
+	isc_uint8_t *aaaa;
+	isc_result_t result;
+
+	REQUIRE(srdatasetp != NULL && *srdatasetp == NULL);
+
+	/*
+	 * Initialize the synthetic AAAA RR list.
+	 */
+	srdatalist = NULL;
+	result = dns_message_gettemprdatalist(client->message, &srdatalist);
+	if (result != ISC_R_SUCCESS)
+		return result;
+	srdatalist->rdclass = rdataset->rdclass;
+	srdatalist->type = dns_rdatatype_aaaa;
+	srdatalist->covers = rdataset->covers;
+	srdatalist->ttl = rdataset->ttl;
+	ISC_LIST_INIT(srdatalist->rdata);
+
+	/*
+	 * The rdata of all synthetic AAAA RRs share one buffer, owned by
+	 * the message.
+	 */
+	buffer = NULL;
+	result = isc_buffer_allocate(client->mctx, &buffer,
+				     16 * dns_rdataset_count(rdataset));
+	if (result != ISC_R_SUCCESS)
+		return result;
+	aaaa = isc_buffer_base(buffer);
+	dns_message_takebuffer(client->message, &buffer);
+
+	/*
+	 * Synthesize one AAAA RR per A RR.
+	 */
+	REQUIRE(client->view->dns64_prefix.family == AF_INET6);
+	for (result = dns_rdataset_first(rdataset); result != ISC_R_NOMORE;
+			result = dns_rdataset_next(rdataset)) {
+		dns_rdata_t rdata = DNS_RDATA_INIT;
+
+		if (result != ISC_R_SUCCESS)
+			return result;
+
+		dns_rdataset_current(rdataset, &rdata);
+
+		srdata = NULL;
+		result = dns_message_gettemprdata(client->message, &srdata);
+		if (result != ISC_R_SUCCESS)
+			return result;
+
+		srdata->data = aaaa;
+		srdata->length = 16;
+		srdata->rdclass = rdata.rdclass;
+		srdata->type = dns_rdatatype_aaaa;
+		srdata->flags = rdata.flags;
+
+		synthesize_aaaa(client->view->dns64_prefix.type.in6.s6_addr,
+				client->view->dns64_prefixlen,
+				rdata.data, srdata->data);
+		aaaa += 16;
+
+		ISC_LIST_APPEND(srdatalist->rdata, srdata, link);
+	}
+
+	/*
+	 * Make it an rdataset.
+	 */
+	srdataset = NULL;
+	result = dns_message_gettemprdataset(client->message, &srdataset);
+	if (result != ISC_R_SUCCESS)
+		return result;
+	result = dns_rdatalist_tordataset(srdatalist, srdataset);
+	if (result != ISC_R_SUCCESS)
+		return result;
+
+	*srdatasetp = srdataset;
+	return ISC_R_SUCCESS;
+}
+
 static inline isc_result_t
 query_dns64_synth_aaaa(ns_client_t *client)
 {
 	dns_name_t *name;
 	dns_name_t *tmp;
 	dns_rdataset_t *rdataset, *srdataset, *soa;
-	dns_rdata_t *srdata;
-	dns_rdatalist_t *srdatalist;
-	isc_buffer_t *buffer;
 	isc_result_t result;
 
 	/*
@@ -2438,7 +2618,6 @@ query_dns64_synth_aaaa(ns_client_t *client)
 	if (result != ISC_R_SUCCESS)
 		return result;
 
-
 	/*
 	 * Remove SOA from authority section.
 	 */
@@ -2465,65 +2644,11 @@ query_dns64_synth_aaaa(ns_client_t *client)
 			 ISC_R_SUCCESS);
 	}
 
-	/*
-	 * Initialize the synthetic AAAA RR list.
-	 */
-	srdatalist = NULL;
-	result = dns_message_gettemprdatalist(client->message, &srdatalist);
-	if (result != ISC_R_SUCCESS)
-		return result;
-	srdatalist->rdclass = rdataset->rdclass;
-	srdatalist->type = dns_rdatatype_aaaa;
-	srdatalist->covers = rdataset->covers;
-	srdatalist->ttl = rdataset->ttl;
-	ISC_LIST_INIT(srdatalist->rdata);
-
-	/*
-	 * Synthesize one AAAA RR per A RR in the answer section.
-	 */
-	for (result = dns_rdataset_first(rdataset); result != ISC_R_NOMORE;
-			result = dns_rdataset_next(rdataset)) {
-		dns_rdata_t rdata = DNS_RDATA_INIT;
-
-		if (result != ISC_R_SUCCESS)
-			return result;
-
-		dns_rdataset_current(rdataset, &rdata);
-
-		srdata = NULL;
-		result = dns_message_gettemprdata(client->message, &srdata);
-		if (result != ISC_R_SUCCESS)
-			return result;
-
-		buffer = NULL;
-		result = isc_buffer_allocate(client->mctx, &buffer, 16);
-		if (result != ISC_R_SUCCESS)
-			return result;
-
-		srdata->data = buffer->base;
-		srdata->length = 16;
-		srdata->rdclass = rdata.rdclass;
-		srdata->type = dns_rdatatype_aaaa;
-		srdata->flags = rdata.flags;
-
-		REQUIRE(client->view->dns64_prefix.family == AF_INET6);
-		synthesize_aaaa(client->view->dns64_prefix.type.in6.s6_addr,
-				client->view->dns64_prefixlen,
-				rdata.data, srdata->data);
-
-		ISC_LIST_APPEND(srdatalist->rdata, srdata, link);
-
-		dns_message_takebuffer(client->message, &buffer);
-	}
-
 	/*
 	 * Add the synthetic AAAA RRset to the response's answer section.
 	 */
 	srdataset = NULL;
-	result = dns_message_gettemprdataset(client->message, &srdataset);
-	if (result != ISC_R_SUCCESS)
-		return result;
-	result = dns_rdatalist_tordataset(srdatalist, srdataset);
+	result = query_dns64_synth_rdataset(client, rdataset, &srdataset);
 	if (result != ISC_R_SUCCESS)
 		return result;
 	query_addrrset(client, &name, &srdataset, NULL, NULL,
@@ -4244,6 +4369,31 @@ query_dns64_change_ptr_qname(ns_client_t *client)
 	return ISC_R_SUCCESS;
 }
 
+/*
+ * Prepare the restart of an AAAA query as an A query.  After a CNAME, qname
+ * already belongs to the query and is kept as it is.  Otherwise qname is the
+ * question name; the new qname shares its data, so that query_reset() can
+ * put it back and nothing has to be allocated for it.
+ */
+static isc_result_t
+query_dns64_restart(ns_client_t *client) {
+	dns_name_t *tname;
+	isc_result_t result;
+
+	if (client->query.restarts == 0) {
+		tname = NULL;
+		result = dns_message_gettempname(client->message, &tname);
+		if (result != ISC_R_SUCCESS)
+			return (result);
+		dns_name_init(tname, NULL);
+		dns_name_clone(client->query.qname, tname);
+		ns_client_qnamereplace(client, tname);
+	}
+	client->query.attributes |= NS_QUERYATTR_DNS64A;
+
+	return (ISC_R_SUCCESS);
+}
+
 #ifdef ALLOW_FILTER_AAAA_ON_V4
 static isc_boolean_t
 is_v4_client(ns_client_t *client) {
@@ -4386,7 +4536,9 @@ query_find(ns_client_t *client, dns_fetchevent_t *event, dns_rdatatype_t qtype)
 			&& client->query.qname->length == 74
 			&& !strcmp((const char*)&client->query.qname->ndata[64],
 				"\03ip6\04arpa")) {
+		CTRACE("query_find: dns64 ptr qname");
 		result = query_dns64_change_ptr_qname(client);
+		CTRACE("query_find: dns64 ptr qname: done");
 		if (result != ISC_R_SUCCESS) {
 			QUERY_ERROR(DNS_R_SERVFAIL);
 			goto cleanup;
@@ -5001,32 +5153,21 @@ query_find(ns_client_t *client, dns_fetchevent_t *event, dns_rdatatype_t qtype)
 			warn_rfc1918(client, fname, rdataset);
 
 		/*
-		 * DNS64: Make an A query.
+		 * DNS64: Make an A query.  Any CNAME chain has been followed
+		 * by now: its records are in the answer section and qname
+		 * is its last name, so the A query starts right there and
+		 * the chain is not walked again.
 		 */
 		if (result == DNS_R_NCACHENXRRSET &&
 		    qtype == dns_rdatatype_aaaa &&
 		    client->view->dns64_prefixlen <= 96) {
-			/*
-			 * Cleanup code, specifically in query_reset(), assumes
-			 * that qname has been dynamically allocated when the
-			 * query has been restarted. Do not disappoint it.
-			 */
-			tname = NULL;
-			result = dns_message_gettempname(client->message,
-					&tname);
+			result = query_dns64_restart(client);
 			if (result != ISC_R_SUCCESS)
 				goto cleanup;
-			result = dns_name_dup(client->query.qname, client->mctx,
-					tname);
-			if (result != ISC_R_SUCCESS) {
-				dns_message_puttempname(client->message,
-						&tname);
-				goto cleanup;
-			}
-			ns_client_qnamereplace(client, tname);
 			/*
 			 * Reset qtype to be A and restart the query.
 			 */
+			CTRACE("query_find: dns64 restart with A");
 			qtype = type = dns_rdatatype_a;
 			want_restart = ISC_TRUE;
 		}
@@ -5235,27 +5376,13 @@ query_find(ns_client_t *client, dns_fetchevent_t *event, dns_rdatatype_t qtype)
 		 */
 		if (qtype == dns_rdatatype_aaaa &&
 		    client->view->dns64_prefixlen <= 96) {
-			/*
-			 * Cleanup code, specifically in query_reset(), assumes
-			 * that qname has been dynamically allocated when the
-			 * query has been restarted. Do not disappoint it.
-			 */
-			tname = NULL;
-			result = dns_message_gettempname(client->message,
-					&tname);
+			result = query_dns64_restart(client);
 			if (result != ISC_R_SUCCESS)
 				goto cleanup;
-			result = dns_name_dup(client->query.qname, client->mctx,
-					tname);
-			if (result != ISC_R_SUCCESS) {
-				dns_message_puttempname(client->message,
-						&tname);
-				goto cleanup;
-			}
-			ns_client_qnamereplace(client, tname);
 			/*
 			 * Reset qtype to be A and restart the query.
 			 */
+			CTRACE("query_find: dns64 restart with A");
 			qtype = type = dns_rdatatype_a;
 			want_restart = ISC_TRUE;
 		} else {
@@ -5656,7 +5783,8 @@ query_find(ns_client_t *client, dns_fetchevent_t *event, dns_rdatatype_t qtype)
 	/*
 	 * DNS64: Synthesize AAAA RRset from A RRset.
 	 */
-	if (client->query.restarts > 0 && qtype == dns_rdatatype_a) {
+	if (DNS64A(client) && qtype == dns_rdatatype_a) {
+		CTRACE("query_find: dns64 synth aaaa");
 		result = query_dns64_synth_aaaa(client);
 
          // append EDNS0 opt
@@ -5665,6 +5793,7 @@ query_find(ns_client_t *client, dns_fetchevent_t *event, dns_rdatatype_t qtype)
                   if ((client->opt) != NULL)
                     result = add_dns64_opt(client);
                 }
+		CTRACE("query_find: dns64 synth aaaa: done");
 		if (result != ISC_R_SUCCESS)
 			QUERY_ERROR(DNS_R_SERVFAIL);
 	}
@@ -5673,7 +5802,9 @@ query_find(ns_client_t *client, dns_fetchevent_t *event, dns_rdatatype_t qtype)
 	 * DNS64: Synthesize ip6.arpa PTR RRset from in-addr.arpa PTR RRset.
 	 */
 	if (client->query.attributes & NS_QUERYATTR_DNS64PTR) {
+		CTRACE("query_find: dns64 synth ptr");
 		query_dns64_synth_ptr(client);
+		CTRACE("query_find: dns64 synth ptr: done");
 
 		/*
 		 * Increment restarts to indicate to the cleanup code that qname
@@ -38,31 +38,50 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <ifaddrs.h>
+#include <limits.h>
 #include <netdb.h>
 #include <nss.h>
+#include <pthread.h>
 #include <resolv.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdio_ext.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <arpa/inet.h>
 #include <net/if.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <sys/utsname.h>
 #include <unistd.h>
 #include <nsswitch.h>
+#include <atomic.h>
 #include <bits/libc-lock.h>
 #include <not-cancel.h>
 #include <nscd/nscd-client.h>
 #include <nscd/nscd_proto.h>
+#include <sysdep.h>
 #include <resolv/res_hconf.h>
 #include <arpa/nameser.h>
+#include <netinet/icmp6.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#ifndef INTERNAL_VSYSCALL
+# define INTERNAL_VSYSCALL INTERNAL_SYSCALL
+#endif
 
 #ifdef HAVE_LIBIDN
 extern int __idna_to_ascii_lz (const char *input, char **output, int flags);
@@ -71,6 +90,16 @@ extern int __idna_to_unicode_lzlz (const char *input, char **output,
 # include <libidn/idna.h>
 #endif
 
+/* SystemTap probes, enabled by building with -DUSE_STAP_PROBE.  */
+#ifndef LIBC_PROBE
+# ifdef USE_STAP_PROBE
+#  include <sys/sdt.h>
+#  define LIBC_PROBE(name, n, ...) STAP_PROBE##n (libc, name, ## __VA_ARGS__)
+# else
+#  define LIBC_PROBE(name, n, ...) do { } while (0)
+# endif
+#endif
+
 #define GAIH_OKIFUNSPEC 0x0100
 #define GAIH_EAI        ~(GAIH_OKIFUNSPEC)
 
@@ -143,7 +172,7 @@ struct gaih
     int family;
     int (*gaih)(const char *name, const struct gaih_service *service,
 		const struct addrinfo *req, struct addrinfo **pai,
-		unsigned int *naddrs);
+		unsigned int *naddrs, int32_t *ttlp);
   };
 
 static const struct addrinfo default_hints =
@@ -159,6 +188,446 @@ static const struct addrinfo default_hints =
   };
 
 
+/* Counters returned by gai_get_stats.  Counting costs atomics on a
+   shared cache line and every timed stage two clock reads, so nothing
+   is counted until gai_get_stats is first called, unless GAI_STATS is
+   set in the environment.  */
+static struct gai_stats gai_stats_data;
+
+/* Whether to count; -1 until the environment has been looked at.  */
+static int gai_stats_on = -1;
+
+static int
+gai_stats_enabled (void)
+{
+  int on = gai_stats_on;
+
+  if (__builtin_expect (on < 0, 0))
+    {
+      on = getenv ("GAI_STATS") != NULL;
+      /* gai_get_stats may have switched it on meanwhile.  */
+      if (atomic_compare_and_exchange_val_acq (&gai_stats_on, on, -1) > 0)
+	on = 1;
+    }
+  return on;
+}
+
+#define GAI_STAT_INC(field)						      \
+  do {									      \
+    if (gai_stats_enabled ())						      \
+      atomic_increment (&gai_stats_data.field);				      \
+  } while (0)
+
+#define GAI_STAT_ADD(field, n)						      \
+  do {									      \
+    if (gai_stats_enabled ())						      \
+      atomic_add (&gai_stats_data.field, (n));				      \
+  } while (0)
+
+/* Take LOCK, counting in gai_stats whether it had to be waited for.  */
+#define gai_lock(lock)							      \
+  do {									      \
+    if (__libc_lock_trylock (lock) != 0)				      \
+      {									      \
+	GAI_STAT_INC (lock_waits);					      \
+	__libc_lock_lock (lock);					      \
+      }									      \
+  } while (0)
+
+static const char *const gai_stage_names[GAI_STAGE_MAX] =
+  {
+    [GAI_STAGE_CHECK_PF] = "check_pf",
+    [GAI_STAGE_INET] = "inet",
+    [GAI_STAGE_EDNS0] = "edns0",
+    [GAI_STAGE_NAT64] = "nat64",
+    [GAI_STAGE_SOURCE] = "source",
+    [GAI_STAGE_SORT] = "sort"
+  };
+
+/* Read CLOCK_MONOTONIC into *TS.  clock_gettime is in librt, so do
+   it the way nptl does.  */
+static void
+gai_clock_monotonic (struct timespec *ts)
+{
+  INTERNAL_SYSCALL_DECL (err);
+  int r = INTERNAL_VSYSCALL (clock_gettime, err, 2, CLOCK_MONOTONIC, ts);
+  if (__builtin_expect (INTERNAL_SYSCALL_ERROR_P (r, err), 0))
+    ts->tv_sec = ts->tv_nsec = 0;
+}
+
+/* Monotonic time in microseconds; never 0.  */
+static uint64_t
+gai_stats_usec (void)
+{
+  struct timespec ts;
+  gai_clock_monotonic (&ts);
+  return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000 + 1;
+}
+
+/* Start STAGE of the lookup of NAME.  Fires the gai_stage_entry probe
+   with the names of the stage and of the host and returns the time to
+   pass to gai_stage_end, 0 if counting is off.  */
+static uint64_t
+gai_stage_begin (int stage, const char *name)
+{
+  LIBC_PROBE (gai_stage_entry, 2, gai_stage_names[stage], name);
+  return gai_stats_enabled () ? gai_stats_usec () : 0;
+}
+
+/* Account for STAGE, begun at START, which ended with RESULT.  Fires
+   the gai_stage_return probe with the name of the stage, RESULT and
+   the microseconds it took, 0 if counting is off.  */
+static void
+gai_stage_end (int stage, uint64_t start, int result)
+{
+  unsigned long int usec = 0;
+
+  if (start != 0)
+    {
+      unsigned int b = 0;
+
+      usec = gai_stats_usec () - start;
+      while (b < GAI_STATS_BUCKETS - 1 && (usec >> b) != 0)
+	++b;
+
+      atomic_increment (&gai_stats_data.stage_calls[stage]);
+      atomic_add (&gai_stats_data.stage_usec[stage], usec);
+      atomic_increment (&gai_stats_data.stage_hist[stage][b]);
+    }
+
+  LIBC_PROBE (gai_stage_return, 3, gai_stage_names[stage], result, usec);
+}
+
+
+void
+gai_get_stats (struct gai_stats *stats)
+{
+  gai_stats_on = 1;
+  memcpy (stats, &gai_stats_data, sizeof (*stats));
+}
+
+
+/* Index of _PATH_SERVICES for gaih_inet_serv.  As long as the files
+   module is the only source of the services database, the names are
+   looked up in this hash table instead of parsing the file through
+   __getservbyname_r on every call.  The file is mapped to build the
+   table; the names are copied into the index so that a file which is
+   truncated later cannot fault a lookup.  The index is rebuilt when
+   the modification time or size of the file changes, which is checked
+   at most every SERVIDX_RECHECK seconds.  */
+#define SERVIDX_RECHECK 1
+
+struct servidx_entry
+{
+  uint32_t hash;		/* Zero if the slot is unused.  */
+  uint32_t name;		/* Offsets into strings.  */
+  uint32_t proto;
+  uint16_t namelen;
+  uint16_t protolen;
+  uint16_t port;		/* In network byte order.  */
+};
+
+struct servidx
+{
+  struct timespec mtime;
+  off64_t size;
+  uint32_t mask;
+  uint32_t used;		/* Bytes of strings in use.  */
+  char *strings;
+  struct servidx *retired;
+  struct servidx_entry entries[];
+};
+
+/* The current index, NULL if the lookups go through NSS.  Replaced
+   indexes are kept until the library is unloaded, they may still be
+   in use.  */
+static struct servidx *servidx_cur;
+static struct servidx *servidx_retired;
+
+/* Whether files is the only module configured for services, -1 if
+   this has not been looked at yet.  */
+static int servidx_usable = -1;
+
+/* When the file is checked next.  */
+static time_t servidx_next_check;
+
+/* Serializes the checks and rebuilds.  */
+__libc_lock_define_initialized (static, servidx_lock);
+
+
+static uint32_t
+servidx_hash (const char *name, size_t namelen, const char *proto,
+	      size_t protolen)
+{
+  uint32_t h = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < namelen; ++i)
+    h = (h ^ (unsigned char) name[i]) * 16777619u;
+  h = (h ^ '/') * 16777619u;
+  for (i = 0; i < protolen; ++i)
+    h = (h ^ (unsigned char) proto[i]) * 16777619u;
+
+  return h ?: 1;
+}
+
+
+/* Return the slot for NAME and PROTO in IDX: the entry if there is
+   one, otherwise the free slot where it belongs.  */
+static struct servidx_entry *
+servidx_slot (const struct servidx *idx, uint32_t hash, const char *name,
+	      size_t namelen, const char *proto, size_t protolen)
+{
+  uint32_t i = hash & idx->mask;
+  const struct servidx_entry *e;
+
+  while ((e = &idx->entries[i])->hash != 0)
+    {
+      if (e->hash == hash && e->namelen == namelen
+	  && e->protolen == protolen
+	  && memcmp (idx->strings + e->name, name, namelen) == 0
+	  && memcmp (idx->strings + e->proto, proto, protolen) == 0)
+	break;
+      i = (i + 1) & idx->mask;
+    }
+
+  return (struct servidx_entry *) e;
+}
+
+
+/* Parse the LEN bytes of the services file at MAP.  If IDX is not
+   NULL, add the names and aliases to it; like for the files module
+   the first line which mentions a name wins.  Return the number of
+   names found.  */
+static size_t
+servidx_parse (const char *map, size_t len, struct servidx *idx)
+{
+  const char *end = map + len;
+  const char *cp = map;
+  size_t count = 0;
+
+  for (; cp < end; cp = memchr (cp, '\n', end - cp) ?: end, ++cp)
+    {
+      const char *eol = memchr (cp, '\n', end - cp) ?: end;
+      const char *lend = memchr (cp, '#', eol - cp) ?: eol;
+      const char *p = cp;
+
+      while (p < lend && isspace (*p))
+	++p;
+      const char *name = p;
+      while (p < lend && !isspace (*p))
+	++p;
+      size_t namelen = p - name;
+      while (p < lend && isspace (*p))
+	++p;
+
+      const char *digits = p;
+      unsigned long int port = 0;
+      while (p < lend && isdigit (*p) && port <= 0xffff)
+	port = port * 10 + (*p++ - '0');
+      if (namelen == 0 || p == digits || port > 0xffff
+	  || p == lend || *p != '/')
+	continue;
+
+      const char *proto = ++p;
+      while (p < lend && !isspace (*p))
+	++p;
+      size_t protolen = p - proto;
+      if (protolen == 0 || protolen > 0xffff)
+	continue;
+
+      uint32_t protooff = 0;
+      if (idx != NULL)
+	{
+	  protooff = idx->used;
+	  memcpy (idx->strings + idx->used, proto, protolen);
+	  idx->used += protolen;
+	}
+
+      while (namelen > 0)
+	{
+	  ++count;
+	  if (idx != NULL && namelen <= 0xffff)
+	    {
+	      uint32_t hash = servidx_hash (name, namelen, proto, protolen);
+	      struct servidx_entry *e = servidx_slot (idx, hash, name,
+						       namelen, proto,
+						       protolen);
+	      if (e->hash == 0)
+		{
+		  e->hash = hash;
+		  e->name = idx->used;
+		  e->namelen = namelen;
+		  e->proto = protooff;
+		  e->protolen = protolen;
+		  e->port = htons (port);
+		  memcpy (idx->strings + idx->used, name, namelen);
+		  idx->used += namelen;
+		}
+	    }
+
+	  while (p < lend && isspace (*p))
+	    ++p;
+	  name = p;
+	  while (p < lend && !isspace (*p))
+	    ++p;
+	  namelen = p - name;
+	}
+    }
+
+  return count;
+}
+
+
+/* Build an index of _PATH_SERVICES.  Return NULL if this is not
+   possible.  */
+static struct servidx *
+servidx_build (void)
+{
+  int fd = open_not_cancel_2 (_PATH_SERVICES, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
+
+  struct servidx *idx = NULL;
+  struct stat64 st;
+  if (__fxstat64 (_STAT_VER, fd, &st) == 0
+      && st.st_size > 0 && st.st_size < UINT32_MAX)
+    {
+      void *map = __mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map != MAP_FAILED)
+	{
+	  size_t n = servidx_parse (map, st.st_size, NULL);
+	  size_t size = 16;
+	  while (size < 2 * n)
+	    size *= 2;
+
+	  /* Every name, alias and protocol is copied once at most, so
+	     the strings fit into the size of the file.  */
+	  idx = calloc (1, sizeof (*idx) + size * sizeof (idx->entries[0]));
+	  if (idx != NULL
+	      && (idx->strings = malloc (st.st_size)) == NULL)
+	    {
+	      free (idx);
+	      idx = NULL;
+	    }
+	  if (idx != NULL)
+	    {
+	      idx->mtime = st.st_mtim;
+	      idx->size = st.st_size;
+	      idx->mask = size - 1;
+	      servidx_parse (map, st.st_size, idx);
+	    }
+
+	  __munmap (map, st.st_size);
+	}
+    }
+
+  close_not_cancel_no_status (fd);
+  return idx;
+}
+
+
+/* Replace the index if the file changed.  Must be called with
+   servidx_lock held.  */
+static void
+servidx_refresh (void)
+{
+  if (servidx_usable < 0)
+    {
+      service_user *nip = NULL;
+      servidx_usable = (__nss_database_lookup ("services", NULL, NULL,
+					       &nip) == 0
+			&& nip != NULL
+			&& nip->next == NULL
+			&& strcmp (nip->name, "files") == 0);
+    }
+  if (! servidx_usable)
+    return;
+
+  struct servidx *old = servidx_cur;
+  struct stat64 st;
+  if (old != NULL
+      && __xstat64 (_STAT_VER, _PATH_SERVICES, &st) == 0
+      && st.st_size == old->size
+      && memcmp (&st.st_mtim, &old->mtime, sizeof (old->mtime)) == 0)
+    return;
+
+  struct servidx *idx = servidx_build ();
+  atomic_write_barrier ();
+  servidx_cur = idx;
+
+  if (old != NULL)
+    {
+      old->retired = servidx_retired;
+      servidx_retired = old;
+    }
+}
+
+
+/* Look up SERVICENAME for the protocol PROTO in the index.  Return 1
+   and store the port in *PORTP if it is found, 0 if the files module
+   would not find it either, and -1 if NSS has to be asked.  */
+static int
+servidx_lookup (const char *servicename, const char *proto, uint16_t *portp)
+{
+  time_t now = time (NULL);
+
+  if (now >= servidx_next_check && __libc_lock_trylock (servidx_lock) == 0)
+    {
+      if (now >= servidx_next_check)
+	{
+	  servidx_next_check = now + SERVIDX_RECHECK;
+	  servidx_refresh ();
+	}
+      __libc_lock_unlock (servidx_lock);
+    }
+
+  struct servidx *idx = servidx_cur;
+  atomic_read_barrier ();
+  size_t namelen = strlen (servicename);
+  size_t protolen = strlen (proto);
+  if (idx == NULL || namelen > 0xffff || protolen > 0xffff)
+    return -1;
+
+  uint32_t hash = servidx_hash (servicename, namelen, proto, protolen);
+  const struct servidx_entry *e = servidx_slot (idx, hash, servicename,
+						 namelen, proto, protolen);
+  if (e->hash == 0)
+    return 0;
+
+  *portp = e->port;
+  return 1;
+}
+
+
+static void
+servidx_free (struct servidx *idx)
+{
+  free (idx->strings);
+  free (idx);
+}
+
+
+libc_freeres_fn(servidx_fini)
+{
+  if (servidx_cur != NULL)
+    {
+      servidx_free (servidx_cur);
+      servidx_cur = NULL;
+    }
+
+  while (servidx_retired != NULL)
+    {
+      struct servidx *old = servidx_retired;
+      servidx_retired = old->retired;
+      servidx_free (old);
+    }
+
+  servidx_usable = -1;
+  servidx_next_check = 0;
+}
+
+
 static int
 gaih_inet_serv (const char *servicename, const struct gaih_typeproto *tp,
 		const struct addrinfo *req, struct gaih_servtuple *st)
@@ -167,65 +636,222 @@ gaih_inet_serv (const char *servicename, const struct gaih_typeproto *tp,
   size_t tmpbuflen = 1024;
   struct servent ts;
   char *tmpbuf;
+  uint16_t port;
   int r;
 
-  do
+  r = servidx_lookup (servicename, tp->name, &port);
+  if (r == 0)
+    return GAIH_OKIFUNSPEC | -EAI_SERVICE;
+  if (r < 0)
     {
-      tmpbuf = __alloca (tmpbuflen);
-
-      r = __getservbyname_r (servicename, tp->name, &ts, tmpbuf, tmpbuflen,
-			     &s);
-      if (r != 0 || s == NULL)
+      do
 	{
-	  if (r == ERANGE)
-	    tmpbuflen *= 2;
-	  else
-	    return GAIH_OKIFUNSPEC | -EAI_SERVICE;
+	  tmpbuf = __alloca (tmpbuflen);
+
+	  r = __getservbyname_r (servicename, tp->name, &ts, tmpbuf,
+				 tmpbuflen, &s);
+	  if (r != 0 || s == NULL)
+	    {
+	      if (r == ERANGE)
+		tmpbuflen *= 2;
+	      else
+		return GAIH_OKIFUNSPEC | -EAI_SERVICE;
+	    }
 	}
+      while (r);
+
+      port = s->s_port;
     }
-  while (r);
 
   st->next = NULL;
   st->socktype = tp->socktype;
   st->protocol = ((tp->protoflag & GAI_PROTO_PROTOANY)
 		  ? req->ai_protocol : tp->protocol);
-  st->port = s->s_port;
+  st->port = port;
 
   return 0;
 }
 
-#define gethosts(_family, _type) \
+/* Per-thread scratch space for the NSS lookups of gaih_inet.  The
+   lookup buffer keeps the size which was last needed, so large RRsets
+   do not go through the ERANGE retries on every call, and the address
+   tuples are carved out of chunks which are kept as well.  */
+#define GAIH_SCRATCH_MIN	1024
+#define GAIH_TUPLE_CHUNK	16
+
+struct gaih_tuplechunk
+{
+  struct gaih_tuplechunk *next;
+  struct gaih_addrtuple tuples[GAIH_TUPLE_CHUNK];
+};
+
+struct gaih_scratch
+{
+  bool in_use;
+  char *buf;
+  size_t buflen;
+  /* Buffers replaced during the current lookup.  Results may still
+     point into them, they are freed by the next lookup.  */
+  char *retired;
+  struct gaih_tuplechunk *chunks;
+  struct gaih_tuplechunk *curchunk;
+  unsigned int curidx;
+};
+
+static __thread struct gaih_scratch gaih_scratch;
+
+
+static void
+gaih_scratch_free_retired (struct gaih_scratch *s)
+{
+  while (s->retired != NULL)
+    {
+      char *next = *(char **) s->retired;
+      free (s->retired);
+      s->retired = next;
+    }
+}
+
+
+/* Called at thread exit.  */
+static void
+gaih_scratch_free (void)
+{
+  struct gaih_scratch *s = &gaih_scratch;
+
+  gaih_scratch_free_retired (s);
+  free (s->buf);
+  s->buf = NULL;
+  s->buflen = 0;
+  while (s->chunks != NULL)
+    {
+      struct gaih_tuplechunk *next = s->chunks->next;
+      free (s->chunks);
+      s->chunks = next;
+    }
+}
+text_set_element (__libc_thread_subfreeres, gaih_scratch_free);
+
+
+/* Return the scratch space of this thread, or NULL if it is already
+   used by an outer lookup (an NSS module may call getaddrinfo) or
+   cannot be allocated.  The caller then uses the stack.  */
+static struct gaih_scratch *
+gaih_scratch_get (void)
+{
+  struct gaih_scratch *s = &gaih_scratch;
+
+  if (s->in_use)
+    return NULL;
+
+  gaih_scratch_free_retired (s);
+
+  if (s->buf == NULL)
+    {
+      s->buf = malloc (GAIH_SCRATCH_MIN);
+      if (s->buf == NULL)
+	return NULL;
+      s->buflen = GAIH_SCRATCH_MIN;
+    }
+
+  s->curchunk = NULL;
+  s->curidx = GAIH_TUPLE_CHUNK;
+  s->in_use = true;
+
+  return s;
+}
+
+
+/* Double the size of the lookup buffer.  */
+static bool
+gaih_scratch_grow (struct gaih_scratch *s)
+{
+  char *newbuf = malloc (2 * s->buflen);
+
+  if (newbuf == NULL)
+    return false;
+
+  *(char **) s->buf = s->retired;
+  s->retired = s->buf;
+  s->buf = newbuf;
+  s->buflen *= 2;
+
+  return true;
+}
+
+
+static struct gaih_addrtuple *
+gaih_scratch_tuple (struct gaih_scratch *s)
+{
+  if (s->curidx == GAIH_TUPLE_CHUNK)
+    {
+      struct gaih_tuplechunk *next = (s->curchunk != NULL
+				      ? s->curchunk->next : s->chunks);
+      if (next == NULL)
+	{
+	  next = malloc (sizeof (*next));
+	  if (next == NULL)
+	    return NULL;
+	  next->next = NULL;
+	  if (s->curchunk != NULL)
+	    s->curchunk->next = next;
+	  else
+	    s->chunks = next;
+	}
+      s->curchunk = next;
+      s->curidx = 0;
+    }
+
+  return &s->curchunk->tuples[s->curidx++];
+}
+
+
+/* Get a new address tuple, from the stack if there is no scratch
+   space.  */
+#define gaih_newtuple() \
+  ({ struct gaih_addrtuple *__t = (scratch != NULL			      \
+				   ? gaih_scratch_tuple (scratch) : NULL);    \
+     __t ?: (struct gaih_addrtuple *) __alloca (sizeof (*__t)); })
+
+/* Double the size of the lookup buffer TMPBUF.  */
+#define gaih_grow_tmpbuf() \
+  do									      \
+    {									      \
+      if (scratch != NULL && gaih_scratch_grow (scratch))		      \
+	{								      \
+	  tmpbuf = scratch->buf;					      \
+	  tmpbuflen = scratch->buflen;					      \
+	}								      \
+      else								      \
+	tmpbuf = extend_alloca (tmpbuf, tmpbuflen, 2 * tmpbuflen);	      \
+    }									      \
+  while (0)
+
+
+/* Convert the result of one gethostbyname3_r/gethostbyname2_r call,
+   described by _R, into address tuples.  NETDB_INTERNAL errors must
+   have been handled by the caller.  */
+#define gethosts_result(_family, _type, _r)				      \
  {									      \
   int i;								      \
-  int herrno;								      \
-  struct hostent th;							      \
   struct hostent *h;							      \
-  char *localcanon = NULL;						      \
   no_data = 0;								      \
-  while (1) {								      \
-    rc = 0;								      \
-    status = DL_CALL_FCT (fct, (name, _family, &th, tmpbuf, tmpbuflen,	      \
-				&rc, &herrno, NULL, &localcanon));	      \
-    if (rc != ERANGE || herrno != NETDB_INTERNAL)			      \
-      break;								      \
-    tmpbuf = extend_alloca (tmpbuf, tmpbuflen, 2 * tmpbuflen);		      \
-  }									      \
+  rc = (_r)->rc;							      \
+  status = (_r)->status;						      \
   if (status == NSS_STATUS_SUCCESS && rc == 0)				      \
-    h = &th;								      \
+    {									      \
+      h = &(_r)->th;							      \
+      if ((_r)->ttl < *ttlp)						      \
+	*ttlp = (_r)->ttl;						      \
+    }									      \
   else									      \
     h = NULL;								      \
   if (rc != 0)								      \
     {									      \
-      if (herrno == NETDB_INTERNAL)					      \
-	{								      \
-	  __set_h_errno (herrno);					      \
-	  _res.options = old_res_options;				      \
-	  return -EAI_SYSTEM;						      \
-	}								      \
-      if (herrno == TRY_AGAIN)						      \
+      if ((_r)->herrno == TRY_AGAIN)					      \
 	no_data = EAI_AGAIN;						      \
       else								      \
-	no_data = herrno == NO_DATA;					      \
+	no_data = (_r)->herrno == NO_DATA;				      \
     }									      \
   else if (h != NULL)							      \
     {									      \
@@ -233,7 +859,7 @@ gaih_inet_serv (const char *servicename, const struct gaih_typeproto *tp,
 	{								      \
 	  if (*pat == NULL)						      \
 	    {								      \
-	      *pat = __alloca (sizeof (struct gaih_addrtuple));		      \
+	      *pat = gaih_newtuple ();					      \
 	      (*pat)->scopeid = 0;					      \
 	    }								      \
 	  uint32_t *addr = (*pat)->addr;				      \
@@ -255,14 +881,37 @@ gaih_inet_serv (const char *servicename, const struct gaih_typeproto *tp,
 	  pat = &((*pat)->next);					      \
 	}								      \
 									      \
-      if (localcanon !=	NULL && canon == NULL)				      \
-	canon = strdupa (localcanon);					      \
+      if ((_r)->localcanon != NULL && canon == NULL)			      \
+	canon = strdupa ((_r)->localcanon);				      \
 									      \
       if (_family == AF_INET6 && i > 0)					      \
 	got_ipv6 = true;						      \
     }									      \
  }
 
+/* Look up the addresses of family _FAMILY with FCT and convert them.  */
+#define gethosts(_family, _type)					      \
+ {									      \
+  struct gaih_hostsreq r;						      \
+  r.ttl = INT32_MAX;							      \
+  r.localcanon = NULL;							      \
+  while (1) {								      \
+    r.rc = 0;								      \
+    r.status = DL_CALL_FCT (fct, (name, _family, &r.th, tmpbuf, tmpbuflen,    \
+				  &r.rc, &r.herrno, &r.ttl, &r.localcanon));  \
+    if (r.rc != ERANGE || r.herrno != NETDB_INTERNAL)			      \
+      break;								      \
+    gaih_grow_tmpbuf ();						      \
+  }									      \
+  if (r.rc != 0 && r.herrno == NETDB_INTERNAL)				      \
+    {									      \
+      __set_h_errno (r.herrno);						      \
+      _res.options = old_res_options;					      \
+      return -EAI_SYSTEM;						      \
+    }									      \
+  gethosts_result (_family, _type, &r);					      \
+ }
+
 
 typedef enum nss_status (*nss_gethostbyname4_r)
   (const char *name, struct gaih_addrtuple **pat,
@@ -277,32 +926,277 @@ typedef enum nss_status (*nss_getcanonname_r)
    int *errnop, int *h_errnop);
 extern service_user *__nss_hosts_database attribute_hidden;
 
-
-static int
-gaih_inet (const char *name, const struct gaih_service *service,
-	   const struct addrinfo *req, struct addrinfo **pai,
-	   unsigned int *naddrs)
+/* One gethostbyname3_r/gethostbyname2_r call.  When a module has no
+   gethostbyname4_r the AF_INET6 and AF_INET queries are independent,
+   so gaih_hosts_both runs the AF_INET6 one in a helper thread while
+   the caller does AF_INET.  Each request owns its buffer; the helper
+   resolves with a copy of the caller's resolver state.  */
+struct gaih_hostsreq
 {
-  const struct gaih_typeproto *tp = gaih_inet_typeproto;
-  struct gaih_servtuple *st = (struct gaih_servtuple *) &nullserv;
-  struct gaih_addrtuple *at = NULL;
+  nss_gethostbyname3_r fct;
+  const char *name;
+  int family;
+  int old_res_options;
+  char *buf;
+  size_t buflen;
+  struct hostent th;
+  enum nss_status status;
   int rc;
-  bool got_ipv6 = false;
-  const char *canon = NULL;
-  const char *orig_name = name;
+  int herrno;
+  int32_t ttl;
+  char *localcanon;
+  struct __res_state res;
+};
 
-  if (req->ai_protocol || req->ai_socktype)
-    {
-      ++tp;
+/* libc cannot depend on libpthread.  The helper thread is only used
+   when the program is linked with it; otherwise these are NULL and the
+   lookups run one after the other.  */
+extern __typeof (pthread_create) pthread_create __attribute__ ((weak));
+extern __typeof (pthread_join) pthread_join __attribute__ ((weak));
+extern __typeof (pthread_cancel) pthread_cancel __attribute__ ((weak));
 
-      while (tp->name[0]
-	     && ((req->ai_socktype != 0 && req->ai_socktype != tp->socktype)
-		 || (req->ai_protocol != 0
-		     && !(tp->protoflag & GAI_PROTO_PROTOANY)
-		     && req->ai_protocol != tp->protocol)))
-	++tp;
+static void *
+gaih_hosts_run (void *arg)
+{
+  struct gaih_hostsreq *r = arg;
 
-      if (! tp->name[0])
+  r->buf = NULL;
+  r->buflen = 0;
+  r->ttl = INT32_MAX;
+  r->localcanon = NULL;
+
+  while (1)
+    {
+      size_t newlen = r->buflen == 0 ? 1024 : 2 * r->buflen;
+      char *newbuf = realloc (r->buf, newlen);
+      if (newbuf == NULL)
+	{
+	  r->status = NSS_STATUS_TRYAGAIN;
+	  r->rc = ENOMEM;
+	  r->herrno = NETDB_INTERNAL;
+	  break;
+	}
+      r->buf = newbuf;
+      r->buflen = newlen;
+
+      r->rc = 0;
+      r->status = DL_CALL_FCT (r->fct, (r->name, r->family, &r->th,
+					 r->buf, r->buflen, &r->rc,
+					 &r->herrno, &r->ttl,
+					 &r->localcanon));
+      if (r->rc != ERANGE || r->herrno != NETDB_INTERNAL)
+	break;
+    }
+
+  return NULL;
+}
+
+/* Start of the helper thread.  _res is per thread, so it gets the
+   servers and options the caller uses, including anything the
+   application set itself, rather than a fresh /etc/resolv.conf.  The
+   sockets and IPv6 server addresses of the copy belong to the caller;
+   the helper opens its own and the addresses are duplicated, so that
+   the thread's resolver cleanup frees only what it owns.  */
+static void *
+gaih_hosts_thread (void *arg)
+{
+  struct gaih_hostsreq *r = arg;
+  int ns;
+
+  _res = r->res;
+  _res._vcsock = -1;
+  _res._flags &= ~(RES_F_VC | RES_F_CONN);
+  for (ns = 0; ns < MAXNS; ++ns)
+    {
+      struct sockaddr_in6 *sin6 = _res._u._ext.nsaddrs[ns];
+
+      _res._u._ext.nssocks[ns] = -1;
+      if (sin6 == NULL)
+	continue;
+      _res._u._ext.nsaddrs[ns] = malloc (sizeof (*sin6));
+      if (_res._u._ext.nsaddrs[ns] == NULL)
+	{
+	  r->buf = NULL;
+	  r->status = NSS_STATUS_TRYAGAIN;
+	  r->rc = ENOMEM;
+	  r->herrno = NETDB_INTERNAL;
+	  return NULL;
+	}
+      memcpy (_res._u._ext.nsaddrs[ns], sin6, sizeof (*sin6));
+    }
+  /* Neither family may be promoted to IPv6.  */
+  _res.options = r->old_res_options & ~RES_USE_INET6;
+
+  return gaih_hosts_run (r);
+}
+
+/* The helper writes into the caller's frame.  If the caller is
+   cancelled in the AF_INET lookup, cancel the helper too, which is
+   waiting in the resolver, and wait for it before that frame goes
+   away.  */
+struct gaih_hostsboth
+{
+  pthread_t th;
+  bool threaded;
+  struct gaih_hostsreq *r6;
+  struct gaih_hostsreq *r4;
+};
+
+static void
+gaih_hosts_cancel (void *arg)
+{
+  struct gaih_hostsboth *b = arg;
+
+  if (b->threaded)
+    {
+      pthread_cancel (b->th);
+      pthread_join (b->th, NULL);
+    }
+  free (b->r6->buf);
+  free (b->r4->buf);
+}
+
+/* Look up the AF_INET6 addresses into R6 and the AF_INET addresses
+   into R4 at the same time if the program is linked with libpthread,
+   one after the other otherwise.  The caller frees both buffers.  */
+static void
+gaih_hosts_both (nss_gethostbyname3_r fct, const char *name,
+		 int old_res_options, struct gaih_hostsreq *r6,
+		 struct gaih_hostsreq *r4)
+{
+  struct gaih_hostsboth b;
+
+  r6->fct = r4->fct = fct;
+  r6->name = r4->name = name;
+  r6->family = AF_INET6;
+  r4->family = AF_INET;
+  r6->old_res_options = r4->old_res_options = old_res_options;
+  r6->buf = r4->buf = NULL;
+  r6->res = _res;
+
+  b.threaded = false;
+  b.r6 = r6;
+  b.r4 = r4;
+  __libc_cleanup_push (gaih_hosts_cancel, &b);
+
+  if (pthread_create != NULL)
+    b.threaded = pthread_create (&b.th, NULL, gaih_hosts_thread, r6) == 0;
+  if (!b.threaded)
+    gaih_hosts_run (r6);
+
+  gaih_hosts_run (r4);
+
+  if (b.threaded)
+    pthread_join (b.th, NULL);
+
+  __libc_cleanup_pop (0);
+}
+
+
+/* All records of one answer, their socket addresses, the NAT64 prefix
+   and the canonical name live in a single allocation.  Every record
+   knows its slot so that freeaddrinfo can find the block from any
+   sublist; the block is freed with its last record.  */
+struct gai_record
+{
+  struct addrinfo ai;
+  union
+  {
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+  } addr;
+  unsigned int slot;
+};
+
+struct gai_block
+{
+  unsigned int refs;
+  unsigned int nrecords;
+  size_t len;
+  struct in6_addr nat64pre;
+  struct gai_record records[];
+  /* The canonical name follows the records.  */
+};
+
+
+static struct gai_block *
+gai_block_alloc (unsigned int nrecords, size_t canonlen)
+{
+  size_t len = (offsetof (struct gai_block, records)
+		+ nrecords * sizeof (struct gai_record) + canonlen);
+  struct gai_block *block = malloc (len);
+
+  if (block != NULL)
+    {
+      block->refs = nrecords;
+      block->nrecords = nrecords;
+      block->len = len;
+      memset (&block->nat64pre, '\0', sizeof (block->nat64pre));
+      for (unsigned int i = 0; i < nrecords; ++i)
+	block->records[i].slot = i;
+    }
+
+  return block;
+}
+
+
+static inline char *
+gai_block_canon (struct gai_block *block)
+{
+  return (char *) &block->records[block->nrecords];
+}
+
+
+static inline struct gai_block *
+gai_block_of (const struct addrinfo *ai)
+{
+  const struct gai_record *rec = (const struct gai_record *) ai;
+
+  return (struct gai_block *) ((char *) (rec - rec->slot)
+			       - offsetof (struct gai_block, records));
+}
+
+
+/* If we looked up IPv4 mapped address discard them if the caller
+   isn't interested in all address and we have found at least one IPv6
+   address.  */
+static inline bool
+gaih_skip_mapped (const struct addrinfo *req, bool got_ipv6,
+		  const struct gaih_addrtuple *at)
+{
+  return (at->family == AF_INET6
+	  && got_ipv6
+	  && (req->ai_flags & (AI_V4MAPPED|AI_ALL)) == AI_V4MAPPED
+	  && IN6_IS_ADDR_V4MAPPED (at->addr));
+}
+
+
+static int
+gaih_inet_lookup (const char *name, const struct gaih_service *service,
+		  const struct addrinfo *req, struct addrinfo **pai,
+		  unsigned int *naddrs, int32_t *ttlp,
+		  struct gaih_scratch *scratch)
+{
+  const struct gaih_typeproto *tp = gaih_inet_typeproto;
+  struct gaih_servtuple *st = (struct gaih_servtuple *) &nullserv;
+  struct gaih_addrtuple *at = NULL;
+  int rc;
+  bool got_ipv6 = false;
+  const char *canon = NULL;
+  const char *orig_name = name;
+
+  if (req->ai_protocol || req->ai_socktype)
+    {
+      ++tp;
+
+      while (tp->name[0]
+	     && ((req->ai_socktype != 0 && req->ai_socktype != tp->socktype)
+		 || (req->ai_protocol != 0
+		     && !(tp->protoflag & GAI_PROTO_PROTOANY)
+		     && req->ai_protocol != tp->protocol)))
+	++tp;
+
+      if (! tp->name[0])
 	{
 	  if (req->ai_socktype)
 	    return GAIH_OKIFUNSPEC | -EAI_SOCKTYPE;
@@ -539,8 +1433,8 @@ gaih_inet (const char *name, const struct gaih_service *service,
 		      || (req->ai_flags & AI_ALL) == 0)))
 	    {
 	      int family = req->ai_family;
-	      size_t tmpbuflen = 512;
-	      char *tmpbuf = alloca (tmpbuflen);
+	      size_t tmpbuflen = scratch != NULL ? scratch->buflen : 512;
+	      char *tmpbuf = scratch != NULL ? scratch->buf : alloca (tmpbuflen);
 	      int rc;
 	      struct hostent th;
 	      struct hostent *h;
@@ -553,7 +1447,7 @@ gaih_inet (const char *name, const struct gaih_service *service,
 					   tmpbuflen, &h, &herrno);
 		  if (rc != ERANGE || herrno != NETDB_INTERNAL)
 		    break;
-		  tmpbuf = extend_alloca (tmpbuf, tmpbuflen, 2 * tmpbuflen);
+		  gaih_grow_tmpbuf ();
 		}
 
 	      if (rc == 0)
@@ -578,7 +1472,7 @@ gaih_inet (const char *name, const struct gaih_service *service,
                          // 2nd round, *pat is NULL
 			  if (*pat == NULL)
 			    {
-			      *pat = __alloca (sizeof (struct gaih_addrtuple));
+			      *pat = gaih_newtuple ();
 			      (*pat)->scopeid = 0;
 			    }
                         // *pat is 'at'
@@ -642,7 +1536,7 @@ gaih_inet (const char *name, const struct gaih_service *service,
 					? INADDRSZ : IN6ADDRSZ);
 		      if (*pat == NULL)
 			{
-			  *pat = __alloca (sizeof (struct gaih_addrtuple));
+			  *pat = gaih_newtuple ();
 			  (*pat)->scopeid = 0;
 			}
 		      uint32_t *pataddr = (*pat)->addr;
@@ -721,8 +1615,8 @@ gaih_inet (const char *name, const struct gaih_service *service,
 	  old_res_options = _res.options;
 	  _res.options &= ~RES_USE_INET6;
 
-	  size_t tmpbuflen = 1024;
-	  char *tmpbuf = alloca (tmpbuflen);
+	  size_t tmpbuflen = scratch != NULL ? scratch->buflen : 1024;
+	  char *tmpbuf = scratch != NULL ? scratch->buf : alloca (tmpbuflen);
 
 	  while (!no_more)
 	    {
@@ -732,13 +1626,14 @@ gaih_inet (const char *name, const struct gaih_service *service,
 	      if (fct4 != NULL)
 		{
 		  int herrno;
+		  int32_t ttl = INT32_MAX;
 
 		  while (1)
 		    {
 		      rc = 0;
 		      status = DL_CALL_FCT (fct4, (name, pat, tmpbuf,
 						   tmpbuflen, &rc, &herrno,
-						   NULL));
+						   &ttl));
 		      if (status == NSS_STATUS_SUCCESS)
 			break;
 		      if (status != NSS_STATUS_TRYAGAIN
@@ -751,14 +1646,16 @@ gaih_inet (const char *name, const struct gaih_service *service,
 			    no_data = herrno == NO_DATA;
 			  break;
 			}
-		      tmpbuf = extend_alloca (tmpbuf,
-					      tmpbuflen, 2 * tmpbuflen);
+		      gaih_grow_tmpbuf ();
 		    }
 
 		  no_inet6_data = no_data;
 
 		  if (status == NSS_STATUS_SUCCESS)
 		    {
+		      if (ttl < *ttlp)
+			*ttlp = ttl;
+
 		      if ((req->ai_flags & AI_CANONNAME) != 0 && canon == NULL)
 			canon = (*pat)->name;
 
@@ -785,20 +1682,50 @@ gaih_inet (const char *name, const struct gaih_service *service,
 
 		  if (fct != NULL)
 		    {
-		      if (req->ai_family == AF_INET6
-			  || req->ai_family == AF_UNSPEC)
+		      if (req->ai_family == AF_UNSPEC
+			  || (req->ai_family == AF_INET6
+			      && (req->ai_flags & (AI_V4MAPPED | AI_ALL))
+				 == (AI_V4MAPPED | AI_ALL)))
+			{
+			  /* Both families are needed no matter what the
+			     AF_INET6 query returns; ask in parallel.  */
+			  struct gaih_hostsreq r6, r4;
+
+			  gaih_hosts_both (fct, name, old_res_options,
+					   &r6, &r4);
+			  if ((r6.rc != 0 && r6.herrno == NETDB_INTERNAL)
+			      || (r4.rc != 0 && r4.herrno == NETDB_INTERNAL))
+			    {
+			      free (r6.buf);
+			      free (r4.buf);
+			      __set_errno (r6.rc != 0
+					   && r6.herrno == NETDB_INTERNAL
+					   ? r6.rc : r4.rc);
+			      __set_h_errno (NETDB_INTERNAL);
+			      _res.options = old_res_options;
+			      return -EAI_SYSTEM;
+			    }
+
+			  gethosts_result (AF_INET6, struct in6_addr, &r6);
+			  no_inet6_data = no_data;
+			  inet6_status = status;
+			  gethosts_result (AF_INET, struct in_addr, &r4);
+
+			  free (r6.buf);
+			  free (r4.buf);
+			}
+		      else if (req->ai_family == AF_INET6)
 			{
 			  gethosts (AF_INET6, struct in6_addr);
 			  no_inet6_data = no_data;
 			  inet6_status = status;
 			}
 		      if (req->ai_family == AF_INET
-			  || req->ai_family == AF_UNSPEC
 			  || (req->ai_family == AF_INET6
 			      && (req->ai_flags & AI_V4MAPPED)
 			      /* Avoid generating the mapped addresses if we
 				 know we are not going to need them.  */
-			      && ((req->ai_flags & AI_ALL) || !got_ipv6)))
+			      && (req->ai_flags & AI_ALL) == 0 && !got_ipv6))
 			{
 			  gethosts (AF_INET, struct in_addr);
 
@@ -916,106 +1843,118 @@ gaih_inet (const char *name, const struct gaih_service *service,
 
   {
     struct gaih_servtuple *st2;
-// 'at' points to the address set, now 'at2' is set to 'at' 
-    struct gaih_addrtuple *at2 = at;
-    size_t socklen;
-    sa_family_t family;
+    struct gaih_addrtuple *at2;
+    unsigned int nrecords = 0;
+    size_t canonlen = 0;
+    char *canonbuf = NULL;
 
-    /*
-      buffer is the size of an unformatted IPv6 address in printable format.
-     */
-    while (at2 != NULL)
+    /* Only the first entry gets the canonical name.  */
+    if ((req->ai_flags & AI_CANONNAME) != 0)
       {
-	/* Only the first entry gets the canonical name.  */
-	if (at2 == at && (req->ai_flags & AI_CANONNAME) != 0)
+	if (canon == NULL)
 	  {
-	    if (canon == NULL)
-	      {
-		struct hostent *h = NULL;
-		int herrno;
-		struct hostent th;
-		size_t tmpbuflen = 512;
-		char *tmpbuf = NULL;
-
-		do
-		  {
-		    tmpbuf = extend_alloca (tmpbuf, tmpbuflen, tmpbuflen * 2);
-		    rc = __gethostbyaddr_r (at2->addr,
-					    ((at2->family == AF_INET6)
-					     ? sizeof (struct in6_addr)
-					     : sizeof (struct in_addr)),
-					    at2->family, &th, tmpbuf,
-					    tmpbuflen, &h, &herrno);
-		  }
-		while (rc == ERANGE && herrno == NETDB_INTERNAL);
-
-		if (rc != 0 && herrno == NETDB_INTERNAL)
-		  {
-		    __set_h_errno (herrno);
-		    return -EAI_SYSTEM;
-		  }
+	    struct hostent *h = NULL;
+	    int herrno;
+	    struct hostent th;
+	    size_t tmpbuflen = 512;
+	    char *tmpbuf = NULL;
 
-		if (h != NULL)
-		  canon = h->h_name;
-		else
-		  {
-		    assert (orig_name != NULL);
-		    /* If the canonical name cannot be determined, use
-		       the passed in string.  */
-		    canon = orig_name;
-		  }
+	    do
+	      {
+		tmpbuf = extend_alloca (tmpbuf, tmpbuflen, tmpbuflen * 2);
+		rc = __gethostbyaddr_r (at->addr,
+					((at->family == AF_INET6)
+					 ? sizeof (struct in6_addr)
+					 : sizeof (struct in_addr)),
+					at->family, &th, tmpbuf,
+					tmpbuflen, &h, &herrno);
 	      }
+	    while (rc == ERANGE && herrno == NETDB_INTERNAL);
 
-#ifdef HAVE_LIBIDN
-	    if (req->ai_flags & AI_CANONIDN)
+	    if (rc != 0 && herrno == NETDB_INTERNAL)
 	      {
-		int idn_flags = 0;
-		if (req->ai_flags & AI_IDN_ALLOW_UNASSIGNED)
-		  idn_flags |= IDNA_ALLOW_UNASSIGNED;
-		if (req->ai_flags & AI_IDN_USE_STD3_ASCII_RULES)
-		  idn_flags |= IDNA_USE_STD3_ASCII_RULES;
-
-		char *out;
-		int rc = __idna_to_unicode_lzlz (canon, &out, idn_flags);
-		if (rc != IDNA_SUCCESS)
-		  {
-		    if (rc == IDNA_MALLOC_ERROR)
-		      return -EAI_MEMORY;
-		    if (rc == IDNA_DLOPEN_ERROR)
-		      return -EAI_SYSTEM;
-		    return -EAI_IDN_ENCODE;
-		  }
-		/* In case the output string is the same as the input
-		   string no new string has been allocated and we
-		   make a copy.  */
-		if (out == canon)
-		  goto make_copy;
+		__set_h_errno (herrno);
+		return -EAI_SYSTEM;
 	      }
+
+	    if (h != NULL)
+	      canon = h->h_name;
 	    else
-#endif
 	      {
+		assert (orig_name != NULL);
+		/* If the canonical name cannot be determined, use
+		   the passed in string.  */
+		canon = orig_name;
+	      }
+	  }
+
 #ifdef HAVE_LIBIDN
-	      make_copy:
-#endif
-		canon = strdup (canon);
-		if (canon == NULL)
+	if (req->ai_flags & AI_CANONIDN)
+	  {
+	    int idn_flags = 0;
+	    if (req->ai_flags & AI_IDN_ALLOW_UNASSIGNED)
+	      idn_flags |= IDNA_ALLOW_UNASSIGNED;
+	    if (req->ai_flags & AI_IDN_USE_STD3_ASCII_RULES)
+	      idn_flags |= IDNA_USE_STD3_ASCII_RULES;
+
+	    char *out;
+	    int rc = __idna_to_unicode_lzlz (canon, &out, idn_flags);
+	    if (rc != IDNA_SUCCESS)
+	      {
+		if (rc == IDNA_MALLOC_ERROR)
 		  return -EAI_MEMORY;
+		if (rc == IDNA_DLOPEN_ERROR)
+		  return -EAI_SYSTEM;
+		return -EAI_IDN_ENCODE;
 	      }
+	    /* In case the output string is the same as the input
+	       string no new string has been allocated.  */
+	    if (out != canon)
+	      canon = canonbuf = out;
 	  }
+#endif
+
+	canonlen = strlen (canon) + 1;
+      }
+
+    /* Count the records first, the whole answer is stored in a single
+       allocation.  */
+    for (at2 = at; at2 != NULL; at2 = at2->next)
+      if (! gaih_skip_mapped (req, got_ipv6, at2))
+	for (st2 = st; st2 != NULL; st2 = st2->next)
+	  ++nrecords;
+
+    if (nrecords == 0)
+      {
+	free (canonbuf);
+	return 0;
+      }
+
+    struct gai_block *block = gai_block_alloc (nrecords, canonlen);
+    if (block == NULL)
+      {
+	free (canonbuf);
+	return -EAI_MEMORY;
+      }
+
+    char *blockcanon = NULL;
+    if (canonlen != 0)
+      blockcanon = memcpy (gai_block_canon (block), canon, canonlen);
+    free (canonbuf);
+
+    struct gai_record *rec = block->records;
+// 'at' points to the address set, now 'at2' is set to 'at' 
+    for (at2 = at; at2 != NULL; at2 = at2->next)
+      {
+	size_t socklen;
+	sa_family_t family;
+
+	if (gaih_skip_mapped (req, got_ipv6, at2))
+	  continue;
 
 	family = at2->family;
 	if (family == AF_INET6)
-	  {
-	    socklen = sizeof (struct sockaddr_in6);
-
-	    /* If we looked up IPv4 mapped address discard them here if
-	       the caller isn't interested in all address and we have
-	       found at least one IPv6 address.  */
-	    if (got_ipv6
-		&& (req->ai_flags & (AI_V4MAPPED|AI_ALL)) == AI_V4MAPPED
-		&& IN6_IS_ADDR_V4MAPPED (at2->addr))
-	      goto ignore;
-	  }
+	  socklen = sizeof (struct sockaddr_in6);
 	else
 	  socklen = sizeof (struct sockaddr_in);
 
@@ -1023,32 +1962,27 @@ gaih_inet (const char *name, const struct gaih_service *service,
 	for (st2 = st; st2 != NULL; st2 = st2->next)
 	  {
 	    struct addrinfo *ai;
-	    ai = *pai = malloc (sizeof (struct addrinfo) + socklen);
-	    if (ai == NULL)
-	      {
-		free ((char *) canon);
-		return -EAI_MEMORY;
-	      }
+	    ai = *pai = &rec->ai;
 
 	    ai->ai_flags = req->ai_flags;
 	    ai->ai_family = family;
 	    ai->ai_socktype = st2->socktype;
 	    ai->ai_protocol = st2->protocol;
 	    ai->ai_addrlen = socklen;
-            // ai+1 is for sockaddr address
-	    ai->ai_addr = (void *) (ai + 1);
+	    ai->ai_addr = (void *) &rec->addr;
 
 	    /* We only add the canonical name once.  */
-	    ai->ai_canonname = (char *) canon;
-	    canon = NULL;
+	    ai->ai_canonname = blockcanon;
+	    blockcanon = NULL;
+
+	    /* Set by getaddrinfo once the prefix is known.  */
+	    ai->ai_nat64pre = NULL;
 
 #ifdef _HAVE_SA_LEN
 	    ai->ai_addr->sa_len = socklen;
 #endif /* _HAVE_SA_LEN */
 	    ai->ai_addr->sa_family = family;
 
-	    /* In case of an allocation error the list must be NULL
-	       terminated.  */
 	    ai->ai_next = NULL;
 
 	    if (family == AF_INET6)
@@ -1073,18 +2007,33 @@ gaih_inet (const char *name, const struct gaih_service *service,
 	      }
 
 	    pai = &(ai->ai_next);
+	    ++rec;
 	  }
 
 	++*naddrs;
-
-      ignore:
-	at2 = at2->next;
       }
   }
   return 0;
 }
 
 
+static int
+gaih_inet (const char *name, const struct gaih_service *service,
+	   const struct addrinfo *req, struct addrinfo **pai,
+	   unsigned int *naddrs, int32_t *ttlp)
+{
+  struct gaih_scratch *scratch = gaih_scratch_get ();
+
+  int result = gaih_inet_lookup (name, service, req, pai, naddrs, ttlp,
+				 scratch);
+
+  if (scratch != NULL)
+    scratch->in_use = false;
+
+  return result;
+}
+
+
 struct sort_result
 {
   struct addrinfo *dest_addr;
@@ -1098,15 +2047,219 @@ struct sort_result
   uint8_t prefixlen;
   uint32_t index;
   int32_t native;
+  uint8_t outcome;		/* gai_outcome_rank of the destination.  */
 };
 
 struct sort_result_combo
 {
   struct sort_result *results;
   int nresults;
+  const struct gaiconf_snapshot *conf;
 };
 
 
+/* Ask the kernel for the route to every destination in RESULTS with a
+   single batch of RTM_GETROUTE requests, one per address, pipelined on
+   one netlink socket.  The reply carries the preferred source address
+   and the outgoing interface.  Entries the kernel does not answer for
+   keep got_source_addr false and are looked up with connect.  */
+static void
+route_sources (struct sort_result *results, int nresults)
+{
+  struct rtreq
+  {
+    struct nlmsghdr nlh;
+    struct rtmsg rtm;
+    char attrs[RTA_SPACE (sizeof (struct in6_addr))
+	       + RTA_SPACE (sizeof (uint32_t))];
+  };
+  int i;
+
+  for (i = 0; i < nresults; ++i)
+    {
+      results[i].got_source_addr = false;
+      results[i].source_addr_len = 0;
+      results[i].source_addr_flags = 0;
+      results[i].prefixlen = 0;
+      results[i].index = 0xffffffffu;
+    }
+
+  size_t reqlen = nresults * sizeof (struct rtreq);
+  bool use_malloc = !__libc_use_alloca (reqlen);
+  char *reqbuf = use_malloc ? malloc (reqlen) : alloca (reqlen);
+  if (reqbuf == NULL)
+    return;
+
+  char *cp = reqbuf;
+  int npending = 0;
+  for (i = 0; i < nresults; ++i)
+    {
+      struct addrinfo *q = results[i].dest_addr;
+      const void *dst;
+      size_t dstlen;
+      uint32_t oif = 0;
+
+      /* Duplicates for other socket types reuse the previous result.  */
+      if (i > 0 && results[i - 1].dest_addr->ai_addrlen == q->ai_addrlen
+	  && memcmp (results[i - 1].dest_addr->ai_addr, q->ai_addr,
+		     q->ai_addrlen) == 0)
+	continue;
+
+      if (q->ai_family == AF_INET)
+	{
+	  dst = &((struct sockaddr_in *) q->ai_addr)->sin_addr;
+	  dstlen = INADDRSZ;
+	}
+      else if (q->ai_family == AF_INET6)
+	{
+	  struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *) q->ai_addr;
+	  /* Mapped addresses depend on the socket options; leave them
+	     to connect.  */
+	  if (IN6_IS_ADDR_V4MAPPED (&sin6->sin6_addr))
+	    continue;
+	  dst = &sin6->sin6_addr;
+	  dstlen = IN6ADDRSZ;
+	  oif = sin6->sin6_scope_id;
+	}
+      else
+	continue;
+
+      struct rtreq *req = (struct rtreq *) cp;
+      struct rtattr *rta;
+      memset (req, '\0', sizeof (*req));
+      req->nlh.nlmsg_len = NLMSG_LENGTH (sizeof (struct rtmsg));
+      req->nlh.nlmsg_type = RTM_GETROUTE;
+      req->nlh.nlmsg_flags = NLM_F_REQUEST;
+      req->nlh.nlmsg_seq = i + 1;
+      req->rtm.rtm_family = q->ai_family;
+      req->rtm.rtm_dst_len = dstlen * 8;
+
+      rta = (struct rtattr *) ((char *) req
+			       + NLMSG_ALIGN (req->nlh.nlmsg_len));
+      rta->rta_type = RTA_DST;
+      rta->rta_len = RTA_LENGTH (dstlen);
+      memcpy (RTA_DATA (rta), dst, dstlen);
+      req->nlh.nlmsg_len = NLMSG_ALIGN (req->nlh.nlmsg_len)
+			   + RTA_SPACE (dstlen);
+
+      if (oif != 0)
+	{
+	  rta = (struct rtattr *) ((char *) req + req->nlh.nlmsg_len);
+	  rta->rta_type = RTA_OIF;
+	  rta->rta_len = RTA_LENGTH (sizeof (oif));
+	  memcpy (RTA_DATA (rta), &oif, sizeof (oif));
+	  req->nlh.nlmsg_len += RTA_SPACE (sizeof (oif));
+	}
+
+      cp += NLMSG_ALIGN (req->nlh.nlmsg_len);
+      ++npending;
+    }
+
+  int fd = -1;
+  if (npending > 0)
+    {
+      GAI_STAT_INC (syscalls);
+      fd = __socket (PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    }
+  if (fd == -1)
+    goto out;
+
+  struct sockaddr_nl nladdr;
+  memset (&nladdr, '\0', sizeof (nladdr));
+  nladdr.nl_family = AF_NETLINK;
+  GAI_STAT_INC (syscalls);
+  if (TEMP_FAILURE_RETRY (__sendto (fd, reqbuf, cp - reqbuf, 0,
+				    (struct sockaddr *) &nladdr,
+				    sizeof (nladdr))) != cp - reqbuf)
+    goto out_close;
+
+  /* The kernel answers while processing the send, so everything it
+     is going to say is queued by now.  */
+  char buf[4096];
+  while (npending > 0)
+    {
+      socklen_t addrlen = sizeof (nladdr);
+      GAI_STAT_INC (syscalls);
+      ssize_t read_len = TEMP_FAILURE_RETRY (__recvfrom (fd, buf,
+							  sizeof (buf),
+							  MSG_DONTWAIT,
+							  (struct sockaddr *)
+							  &nladdr, &addrlen));
+      if (read_len <= 0)
+	break;
+      if (nladdr.nl_pid != 0)
+	continue;
+
+      size_t len = read_len;
+      struct nlmsghdr *nlmh;
+      for (nlmh = (struct nlmsghdr *) buf; NLMSG_OK (nlmh, len);
+	   nlmh = (struct nlmsghdr *) NLMSG_NEXT (nlmh, len))
+	{
+	  if (nlmh->nlmsg_seq == 0 || nlmh->nlmsg_seq > (uint32_t) nresults)
+	    continue;
+	  if (nlmh->nlmsg_type == NLMSG_ERROR)
+	    {
+	      --npending;
+	      continue;
+	    }
+	  if (nlmh->nlmsg_type != RTM_NEWROUTE)
+	    continue;
+	  --npending;
+
+	  struct sort_result *r = &results[nlmh->nlmsg_seq - 1];
+	  struct rtmsg *rtm = (struct rtmsg *) NLMSG_DATA (nlmh);
+	  struct rtattr *rta = RTM_RTA (rtm);
+	  size_t rtalen = RTM_PAYLOAD (nlmh);
+	  const void *src = NULL;
+	  uint32_t oif = 0;
+
+	  if (rtm->rtm_family != r->dest_addr->ai_family)
+	    continue;
+
+	  for (; RTA_OK (rta, rtalen); rta = RTA_NEXT (rta, rtalen))
+	    if (rta->rta_type == RTA_PREFSRC)
+	      src = RTA_DATA (rta);
+	    else if (rta->rta_type == RTA_OIF
+		     && RTA_PAYLOAD (rta) == sizeof (oif))
+	      memcpy (&oif, RTA_DATA (rta), sizeof (oif));
+	  if (src == NULL)
+	    continue;
+
+	  if (rtm->rtm_family == AF_INET)
+	    {
+	      struct sockaddr_in *sin
+		= (struct sockaddr_in *) &r->source_addr;
+	      memset (sin, '\0', sizeof (*sin));
+	      sin->sin_family = AF_INET;
+	      memcpy (&sin->sin_addr, src, INADDRSZ);
+	      r->source_addr_len = sizeof (struct sockaddr_in);
+	    }
+	  else
+	    {
+	      struct sockaddr_in6 *sin6 = &r->source_addr;
+	      memset (sin6, '\0', sizeof (*sin6));
+	      sin6->sin6_family = AF_INET6;
+	      memcpy (&sin6->sin6_addr, src, IN6ADDRSZ);
+	      if (IN6_IS_ADDR_LINKLOCAL (&sin6->sin6_addr))
+		sin6->sin6_scope_id = oif;
+	      r->source_addr_len = sizeof (struct sockaddr_in6);
+	    }
+	  r->got_source_addr = true;
+	  /* Rule 7 only learns the interface of IPv6 sources; IPv4
+	     entries keep 0xffffffff, as with connect.  */
+	  if (oif != 0 && rtm->rtm_family == AF_INET6)
+	    r->index = oif;
+	}
+    }
+
+ out_close:
+  close_not_cancel_no_status (fd);
+ out:
+  if (use_malloc)
+    free (reqbuf);
+}
+
+
 #if __BYTE_ORDER == __BIG_ENDIAN
 # define htonl_c(n) n
 #else
@@ -1135,12 +2288,8 @@ static const struct scopeentry
     { { { 0, 0, 0, 0 } }, htonl_c (0x00000000), 14 }
   };
 
-/* The label table.  */
-static const struct scopeentry *scopes;
-
-
 static int
-get_scope (const struct sockaddr_in6 *in6)
+get_scope (const struct sockaddr_in6 *in6, const struct scopeentry *scopes)
 {
   int scope;
   if (in6->sin6_family == PF_INET6)
@@ -1192,9 +2341,6 @@ struct prefixentry
 };
 
 
-/* The label table.  */
-static const struct prefixentry *labels;
-
 /* Default labels.  */
 static const struct prefixentry default_labels[] =
   {
@@ -1242,9 +2388,9 @@ static const struct prefixentry default_labels[] =
   };
 
 
-/* modified label, non const because we need to insert prefix */
+/* modified label, copied by nat64_policy to insert the prefix */
 
-static struct prefixentry default_labels_modify[] =
+static const struct prefixentry default_labels_modify[] =
   {
     /* See RFC 3484 for the details.  */
     { { .__in6_u
@@ -1288,9 +2434,6 @@ static struct prefixentry default_labels_modify[] =
 
   };
 
-/* The precedence table.  */
-static const struct prefixentry *precedence;
-
 /* The default precedences.  */
 static const struct prefixentry default_precedence[] =
   {
@@ -1319,9 +2462,9 @@ static const struct prefixentry default_precedence[] =
 
 
 /*modify precedences*/
-/*non-const struct, because we need to modify the entry according to new prefix*/
+/*copied by nat64_policy to insert the prefix*/
 
-static struct prefixentry default_precedence_modify[] =
+static const struct prefixentry default_precedence_modify[] =
   {
     /* See RFC 3484 for the details.  */
     { { .__in6_u
@@ -1354,6 +2497,107 @@ static struct prefixentry default_precedence_modify[] =
   };
 
 
+/* Where the NAT64 prefix came from.  */
+#define NAT64_SRC_NONE	0	/* Probed, there is no NAT64 on the path.  */
+#define NAT64_SRC_RA	1	/* PREF64 option in a Router Advertisement.  */
+#define NAT64_SRC_DNS	2	/* EDNS0 SY bits or the heuristic probe.  */
+#define NAT64_SRC_CONF	3	/* nat64prefix in gai.conf.  */
+
+/* How long a prefix learned through DNS is reused by later lookups,
+   and how long the absence of a DNS64 server is remembered.  Every
+   lookup, including those answered by nscd, would otherwise send the
+   discovery queries again.  Can be changed with nat64ttl.  */
+#define NAT64_CACHE_TTL		300
+#define NAT64_NEGATIVE_TTL	30
+
+/* Name probed by the heuristic when the caller gives none, and the
+   IPv4 address it is known to have (127.127.127.127).  Can be changed
+   with nat64probe.  */
+#define NAT64_PROBE_NAME	"ipv4only.neonsite.net"
+#define NAT64_PROBE_ADDR	0x7f7f7f7f
+
+/* Precedence given to synthesized addresses with AI_POLICYTABLE.  */
+#define NAT64_PRECEDENCE	10
+
+
+/* The label, precedence and scope tables in use.  A snapshot is never
+   changed once it is published in gaiconf_cur, and replaced snapshots
+   are kept for GAICONF_GRACE seconds, so lookups read the tables
+   without a lock.  */
+struct gaiconf_snapshot
+{
+  const struct prefixentry *labels;
+  const struct prefixentry *precedence;
+  const struct scopeentry *scopes;
+
+  /* NAT64 settings from the nat64* directives.  */
+  struct in6_addr nat64_prefix;	/* Static prefix.  */
+  uint16_t nat64_len;		/* Its length, 0 if there is none.  */
+  bool nat64_probe;		/* Whether to look for a prefix with DNS.  */
+  const char *nat64_probe_name;
+  struct in_addr nat64_probe_addr;
+  int nat64_ttl;
+  int nat64_negative_ttl;
+  int nat64_precedence;
+  int nat64_label;		/* -1 to leave the labels alone.  */
+
+  struct gaiconf_snapshot *retired;	/* Next replaced snapshot.  */
+  time_t retired_at;		/* When it was replaced.  */
+};
+
+static struct gaiconf_snapshot gaiconf_default =
+  {
+    .labels = default_labels,
+    .precedence = default_precedence,
+    .scopes = default_scopes,
+    .nat64_probe = true,
+    .nat64_probe_name = NAT64_PROBE_NAME,
+    .nat64_probe_addr = { htonl_c (NAT64_PROBE_ADDR) },
+    .nat64_ttl = NAT64_CACHE_TTL,
+    .nat64_negative_ttl = NAT64_NEGATIVE_TTL,
+    .nat64_precedence = NAT64_PRECEDENCE,
+    .nat64_label = -1
+  };
+
+static struct gaiconf_snapshot *gaiconf_cur = &gaiconf_default;
+
+/* Snapshots which have been replaced, the most recent first.  */
+static struct gaiconf_snapshot *gaiconf_retired;
+
+/* Seconds a replaced snapshot is kept.  A lookup which read gaiconf_cur
+   before it was replaced may still use it, so this is far longer than
+   any lookup takes, resolver timeouts included.  */
+#define GAICONF_GRACE 300
+
+
+/* Copy TABLE, one of the N entry *_modify tables, to NEW for one
+   AI_POLICYTABLE lookup.  The last entry, for the NAT64 prefix, gets
+   the value VAL and, unless PREFIX is NULL, the prefix PREFIX/LEN.
+   match_prefix takes the first match, so it is moved in front of the
+   first entry which is not longer, keeping the table in descending
+   order of prefix length; the ::/0 entry before it would otherwise
+   match first.  */
+static void
+nat64_policy (struct prefixentry *new, const struct prefixentry *table,
+	      size_t n, const struct in6_addr *prefix, uint16_t len, int val)
+{
+  struct prefixentry e = table[n - 1];
+  size_t i;
+
+  if (prefix != NULL)
+    {
+      e.prefix = *prefix;
+      e.bits = len;
+    }
+  e.val = val;
+
+  for (i = 0; i < n - 1 && table[i].bits > e.bits; ++i)
+    new[i] = table[i];
+  new[i] = e;
+  memcpy (&new[i + 1], &table[i], (n - 1 - i) * sizeof (*table));
+}
+
+
 static int
 match_prefix (const struct sockaddr_in6 *in6,
 	      const struct prefixentry *list, int default_val)
@@ -1408,7 +2652,7 @@ match_prefix (const struct sockaddr_in6 *in6,
 
 
 static int
-get_label (const struct sockaddr_in6 *in6)
+get_label (const struct sockaddr_in6 *in6, const struct prefixentry *labels)
 {
   /* XXX What is a good default value?  */
   return match_prefix (in6, labels, INT_MAX);
@@ -1416,7 +2660,8 @@ get_label (const struct sockaddr_in6 *in6)
 
 
 static int
-get_precedence (const struct sockaddr_in6 *in6)
+get_precedence (const struct sockaddr_in6 *in6,
+		const struct prefixentry *precedence)
 {
   /* XXX What is a good default value?  */
   return match_prefix (in6, precedence, 0);
@@ -1444,6 +2689,7 @@ rfc3484_sort (const void *p1, const void *p2, void *arg)
   struct sort_result_combo *src = (struct sort_result_combo *) arg;
   struct sort_result *a1 = &src->results[idx1];
   struct sort_result *a2 = &src->results[idx2];
+  const struct gaiconf_snapshot *conf = src->conf;
 
   /* Rule 1: Avoid unusable destinations.
      We have the got_source_addr flag set if the destination is reachable.  */
@@ -1456,15 +2702,17 @@ rfc3484_sort (const void *p1, const void *p2, void *arg)
   /* Rule 2: Prefer matching scope.  Only interesting if both
      destination addresses are IPv6.  */
   int a1_dst_scope
-    = get_scope ((struct sockaddr_in6 *) a1->dest_addr->ai_addr);
+    = get_scope ((struct sockaddr_in6 *) a1->dest_addr->ai_addr,
+		 conf->scopes);
 
   int a2_dst_scope
-    = get_scope ((struct sockaddr_in6 *) a2->dest_addr->ai_addr);
+    = get_scope ((struct sockaddr_in6 *) a2->dest_addr->ai_addr,
+		 conf->scopes);
 
   if (a1->got_source_addr)
     {
-      int a1_src_scope = get_scope (&a1->source_addr);
-      int a2_src_scope = get_scope (&a2->source_addr);
+      int a1_src_scope = get_scope (&a1->source_addr, conf->scopes);
+      int a2_src_scope = get_scope (&a2->source_addr, conf->scopes);
 
       if (a1_dst_scope == a1_src_scope && a2_dst_scope != a2_src_scope)
 	return -1;
@@ -1499,12 +2747,14 @@ rfc3484_sort (const void *p1, const void *p2, void *arg)
   if (a1->got_source_addr)
     {
       int a1_dst_label
-	= get_label ((struct sockaddr_in6 *) a1->dest_addr->ai_addr);
-      int a1_src_label = get_label (&a1->source_addr);
+	= get_label ((struct sockaddr_in6 *) a1->dest_addr->ai_addr,
+		     conf->labels);
+      int a1_src_label = get_label (&a1->source_addr, conf->labels);
 
       int a2_dst_label
-	= get_label ((struct sockaddr_in6 *) a2->dest_addr->ai_addr);
-      int a2_src_label = get_label (&a2->source_addr);
+	= get_label ((struct sockaddr_in6 *) a2->dest_addr->ai_addr,
+		     conf->labels);
+      int a2_src_label = get_label (&a2->source_addr, conf->labels);
 
       if (a1_dst_label == a1_src_label && a2_dst_label != a2_src_label)
 	return -1;
@@ -1513,11 +2763,23 @@ rfc3484_sort (const void *p1, const void *p2, void *arg)
     }
 
 
+  /* Rule 5.5: Avoid destinations whose prefix was recently reported
+     slow or failing by gai_report_connect.  This is not part of RFC
+     3484 but has to come before the static precedence to steer away
+     from a broken NAT64 translator.  */
+  if (a1->outcome < a2->outcome)
+    return -1;
+  if (a1->outcome > a2->outcome)
+    return 1;
+
+
   /* Rule 6: Prefer higher precedence.  */
   int a1_prec
-    = get_precedence ((struct sockaddr_in6 *) a1->dest_addr->ai_addr);
+    = get_precedence ((struct sockaddr_in6 *) a1->dest_addr->ai_addr,
+		      conf->precedence);
   int a2_prec
-    = get_precedence ((struct sockaddr_in6 *) a2->dest_addr->ai_addr);
+    = get_precedence ((struct sockaddr_in6 *) a2->dest_addr->ai_addr,
+		      conf->precedence);
 
   if (a1_prec > a2_prec)
     return -1;
@@ -1688,42 +2950,191 @@ in6aicmp (const void *p1, const void *p2)
 }
 
 
-/* Name of the config file for RFC 3484 sorting (for now).  */
-#define GAICONF_FNAME "/etc/gai.conf"
-
-
-/* Non-zero if we are supposed to reload the config file automatically
-   whenever it changed.  */
-static int gaiconf_reload_flag;
-
-/* Non-zero if gaiconf_reload_flag was ever set to true.  */
-static int gaiconf_reload_flag_ever_set;
-
-/* Last modification time.  */
-static struct timespec gaiconf_mtime;
-
-
-libc_freeres_fn(fini)
+/* Restore the heap property below entry J of the N entries of ORDER.
+   The root is the entry which sorts last.  */
+static void
+rfc3484_sift (size_t *order, int n, int j, struct sort_result_combo *src)
 {
-  if (labels != default_labels)
+  while (2 * j + 1 < n)
     {
-      const struct prefixentry *old = labels;
-      labels = default_labels;
-      free ((void *) old);
+      int c = 2 * j + 1;
+      if (c + 1 < n && rfc3484_sort (&order[c + 1], &order[c], src) > 0)
+	++c;
+      if (rfc3484_sort (&order[c], &order[j], src) < 0)
+	break;
+      size_t t = order[j];
+      order[j] = order[c];
+      order[c] = t;
+      j = c;
     }
+}
 
-  if (precedence != default_precedence)
+
+/* Put the KEEP best of the NRESULTS entries of ORDER, sorted, at its
+   beginning.  With KEEP smaller than NRESULTS only a heap of KEEP
+   entries is maintained, which needs O(n log KEEP) comparisons instead
+   of a full sort.  rfc3484_sort never returns 0, since rule 10 breaks
+   ties by the order the entries were received in, but it is not a
+   total order: for two IPv6 destinations rule 9 measures both common
+   prefixes at the first word in which either pair differs, which is
+   not transitive.  For such input the entries kept need not be the
+   first ones of qsort_r's result, which then depends on its algorithm
+   as well; otherwise they are the same.  */
+static void
+rfc3484_select (size_t *order, int nresults, int keep,
+		struct sort_result_combo *src)
+{
+  int i;
+
+  if (keep >= nresults)
+    {
+      qsort_r (order, nresults, sizeof (order[0]), rfc3484_sort, src);
+      return;
+    }
+
+  for (i = keep / 2 - 1; i >= 0; --i)
+    rfc3484_sift (order, keep, i, src);
+
+  /* Replace the worst entry kept so far by every better one.  */
+  for (i = keep; i < nresults; ++i)
+    if (rfc3484_sort (&order[i], &order[0], src) < 0)
+      {
+	size_t t = order[0];
+	order[0] = order[i];
+	order[i] = t;
+	rfc3484_sift (order, keep, 0, src);
+      }
+
+  for (i = keep - 1; i > 0; --i)
+    {
+      size_t t = order[0];
+      order[0] = order[i];
+      order[i] = t;
+      rfc3484_sift (order, i, 0, src);
+    }
+}
+
+
+/* Name of the config file for RFC 3484 sorting (for now).  */
+#define GAICONF_FNAME "/etc/gai.conf"
+
+
+/* Non-zero if we are supposed to reload the config file automatically
+   whenever it changed.  */
+static int gaiconf_reload_flag;
+
+/* Non-zero if gaiconf_reload_flag was ever set to true.  */
+static int gaiconf_reload_flag_ever_set;
+
+/* Last modification time.  */
+static struct timespec gaiconf_mtime;
+
+/* The file is watched in its directory so that replacing it is seen.  */
+#define GAICONF_DIR "/etc"
+#define GAICONF_BASENAME "gai.conf"
+
+/* Seconds between two checks whether the file changed.  */
+#define GAICONF_RECHECK 1
+
+/* inotify descriptor watching GAICONF_DIR and the process which
+   created it.  */
+static int gaiconf_ifd = -1;
+static pid_t gaiconf_ipid;
+
+/* When the file is checked next.  */
+static time_t gaiconf_next_check;
+
+/* Makes sure the file has been read once.  */
+__libc_once_define (static, gaiconf_once);
+
+/* Serializes the checks and reloads.  */
+__libc_lock_define_initialized (static, gaiconf_lock);
+
+/* Incremented whenever the policy tables are replaced.  Cached
+   answers depend on it, so it is left alone while nothing changes.  */
+static unsigned int gaiconf_version;
+
+
+static void
+gaiconf_free (struct gaiconf_snapshot *snap)
+{
+  if (snap == &gaiconf_default)
+    return;
+  if (snap->labels != default_labels)
+    free ((void *) snap->labels);
+  if (snap->precedence != default_precedence)
+    free ((void *) snap->precedence);
+  if (snap->scopes != default_scopes)
+    free ((void *) snap->scopes);
+  if (snap->nat64_probe_name != gaiconf_default.nat64_probe_name)
+    free ((void *) snap->nat64_probe_name);
+  free (snap);
+}
+
+
+static void nat64_conf_changed (void);
+
+/* Make SNAP the current snapshot.  */
+static void
+gaiconf_publish (struct gaiconf_snapshot *snap)
+{
+  struct gaiconf_snapshot *old = gaiconf_cur;
+
+  atomic_write_barrier ();
+  gaiconf_cur = snap;
+  ++gaiconf_version;
+
+  if (old->nat64_len != snap->nat64_len
+      || memcmp (&old->nat64_prefix, &snap->nat64_prefix,
+		 sizeof (struct in6_addr)) != 0)
+    nat64_conf_changed ();
+
+  if (old != &gaiconf_default)
+    {
+      old->retired = gaiconf_retired;
+      old->retired_at = time (NULL);
+      gaiconf_retired = old;
+    }
+}
+
+
+/* Free the snapshots replaced more than GAICONF_GRACE seconds before
+   NOW.  Must be called with gaiconf_lock held.  */
+static void
+gaiconf_free_retired (time_t now)
+{
+  struct gaiconf_snapshot **oldp = &gaiconf_retired;
+
+  while (*oldp != NULL && now - (*oldp)->retired_at <= GAICONF_GRACE)
+    oldp = &(*oldp)->retired;
+
+  struct gaiconf_snapshot *old = *oldp;
+  *oldp = NULL;
+  while (old != NULL)
+    {
+      struct gaiconf_snapshot *next = old->retired;
+      gaiconf_free (old);
+      old = next;
+    }
+}
+
+
+libc_freeres_fn(fini)
+{
+  gaiconf_free (gaiconf_cur);
+  gaiconf_cur = &gaiconf_default;
+
+  while (gaiconf_retired != NULL)
     {
-      const struct prefixentry *old = precedence;
-      precedence = default_precedence;
-      free ((void *) old);
+      struct gaiconf_snapshot *old = gaiconf_retired;
+      gaiconf_retired = old->retired;
+      gaiconf_free (old);
     }
 
-  if (scopes != default_scopes)
+  if (gaiconf_ifd != -1)
     {
-      const struct scopeentry *old = scopes;
-      scopes = default_scopes;
-      free ((void *) old);
+      close_not_cancel_no_status (gaiconf_ifd);
+      gaiconf_ifd = -1;
     }
 }
 
@@ -1806,6 +3217,8 @@ gaiconf_init (void)
   struct scopelist *scopelist =  NULL;
   size_t nscopelist = 0;
   bool scopelist_nullbits = false;
+  /* Collects the NAT64 settings.  */
+  struct gaiconf_snapshot conf = gaiconf_default;
 
   FILE *fp = fopen (GAICONF_FNAME, "rc");
   if (fp != NULL)
@@ -1930,6 +3343,33 @@ gaiconf_init (void)
 		}
 	      break;
 
+	    case 8:
+	      if (strcmp (cmd, "nat64ttl") == 0)
+		{
+		  unsigned long int ttl;
+		  unsigned long int negttl;
+		  char *endp;
+
+		  /* The second value is optional; without it the
+		     negative TTL keeps its default.  */
+		  __set_errno (0);
+		  if (((ttl = strtoul (val1, &endp, 10)) != ULONG_MAX
+		       || errno != ERANGE)
+		      && endp != val1 && *endp == '\0' && ttl <= INT_MAX)
+		    {
+		      negttl = conf.nat64_negative_ttl;
+		      if (*val2 == '\0'
+			  || (((negttl = strtoul (val2, &endp, 10))
+			       != ULONG_MAX || errno != ERANGE)
+			      && *endp == '\0' && negttl <= INT_MAX))
+			{
+			  conf.nat64_ttl = ttl;
+			  conf.nat64_negative_ttl = negttl;
+			}
+		    }
+		}
+	      break;
+
 	    case 7:
 	      if (strcmp (cmd, "scopev4") == 0)
 		{
@@ -2006,6 +3446,85 @@ gaiconf_init (void)
 		  nullbitsp = &precedencelist_nullbits;
 		  goto new_elem;
 		}
+	      else if (strcmp (cmd, "nat64probe") == 0)
+		{
+		  struct in_addr addr;
+
+		  if (strcmp (val1, "no") == 0)
+		    conf.nat64_probe = false;
+		  else if (inet_pton (AF_INET, val2, &addr) > 0)
+		    {
+		      char *name = strdup (val1);
+		      if (name == NULL)
+			{
+			  free (line);
+			  fclose (fp);
+			  goto no_file;
+			}
+
+		      if (conf.nat64_probe_name
+			  != gaiconf_default.nat64_probe_name)
+			free ((void *) conf.nat64_probe_name);
+		      conf.nat64_probe = true;
+		      conf.nat64_probe_name = name;
+		      conf.nat64_probe_addr = addr;
+		    }
+		}
+	      else if (strcmp (cmd, "nat64label") == 0)
+		{
+		  unsigned long int val;
+		  char *endp;
+
+		  __set_errno (0);
+		  if (((val = strtoul (val1, &endp, 10)) != ULONG_MAX
+		       || errno != ERANGE)
+		      && *endp == '\0' && val <= INT_MAX)
+		    conf.nat64_label = val;
+		}
+	      break;
+
+	    case 11:
+	      if (strcmp (cmd, "nat64prefix") == 0)
+		{
+		  struct in6_addr prefix;
+		  unsigned long int bits = 96;
+		  char *endp = NULL;
+
+		  __set_errno (0);
+		  cp = strchr (val1, '/');
+		  if (cp != NULL)
+		    *cp++ = '\0';
+		  if (inet_pton (AF_INET6, val1, &prefix)
+		      && (cp == NULL
+			  || (((bits = strtoul (cp, &endp, 10)) != ULONG_MAX
+			       || errno != ERANGE)
+			      && *endp == '\0')))
+		    {
+		      /* Only the lengths of RFC 6052 are allowed.  */
+		      if (bits == 32 || bits == 40 || bits == 48
+			  || bits == 56 || bits == 64 || bits == 96)
+			{
+			  memset (&conf.nat64_prefix, '\0',
+				  sizeof (struct in6_addr));
+			  memcpy (&conf.nat64_prefix, &prefix, bits / 8);
+			  conf.nat64_len = bits;
+			}
+		    }
+		}
+	      break;
+
+	    case 15:
+	      if (strcmp (cmd, "nat64precedence") == 0)
+		{
+		  unsigned long int val;
+		  char *endp;
+
+		  __set_errno (0);
+		  if (((val = strtoul (val1, &endp, 10)) != ULONG_MAX
+		       || errno != ERANGE)
+		      && *endp == '\0' && val <= INT_MAX)
+		    conf.nat64_precedence = val;
+		}
 	      break;
 	    }
 	}
@@ -2129,20 +3648,26 @@ gaiconf_init (void)
 	new_scopes = (struct scopeentry *) default_scopes;
 
       /* Now we are ready to replace the values.  */
-      const struct prefixentry *old = labels;
-      labels = new_labels;
-      if (old != default_labels)
-	free ((void *) old);
-
-      old = precedence;
-      precedence = new_precedence;
-      if (old != default_precedence)
-	free ((void *) old);
-
-      const struct scopeentry *oldscope = scopes;
-      scopes = new_scopes;
-      if (oldscope != default_scopes)
-	free ((void *) oldscope);
+      struct gaiconf_snapshot *snap = malloc (sizeof (*snap));
+      if (snap == NULL)
+	{
+	  if (new_labels != default_labels)
+	    free (new_labels);
+	  if (new_precedence != default_precedence)
+	    free (new_precedence);
+	  if (new_scopes != default_scopes)
+	    free (new_scopes);
+	  if (conf.nat64_probe_name != gaiconf_default.nat64_probe_name)
+	    free ((void *) conf.nat64_probe_name);
+	  /* Keep the old tables.  */
+	  return;
+	}
+      *snap = conf;
+      snap->labels = new_labels;
+      snap->precedence = new_precedence;
+      snap->scopes = new_scopes;
+      snap->retired = NULL;
+      gaiconf_publish (snap);
 
       gaiconf_mtime = st.st_mtim;
     }
@@ -2152,22 +3677,99 @@ gaiconf_init (void)
       free_prefixlist (labellist);
       free_prefixlist (precedencelist);
       free_scopelist (scopelist);
+      if (conf.nat64_probe_name != gaiconf_default.nat64_probe_name)
+	free ((void *) conf.nat64_probe_name);
+
+      /* If we previously read the file but it is gone now, use the
+	 builtin data.  Leave the reload flag alone.  */
+      if (gaiconf_cur != &gaiconf_default)
+	gaiconf_publish (&gaiconf_default);
+      memset (&gaiconf_mtime, '\0', sizeof (gaiconf_mtime));
+    }
+}
+
 
-      /* If we previously read the file but it is gone now, free the
-	 old data and use the builtin one.  Leave the reload flag
-	 alone.  */
-      fini ();
+/* Return true if GAICONF_FNAME may have changed since it was read.
+   Must be called with gaiconf_lock held.  */
+static bool
+gaiconf_changed (void)
+{
+  if (gaiconf_ifd != -1 && gaiconf_ipid != __getpid ())
+    {
+      /* We have been forked; the parent reads the same queue.  */
+      close_not_cancel_no_status (gaiconf_ifd);
+      gaiconf_ifd = -1;
     }
+
+  if (gaiconf_ifd != -1)
+    {
+      char buf[4096]
+	__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+      bool changed = false;
+      ssize_t n;
+
+      while ((n = read_not_cancel (gaiconf_ifd, buf, sizeof (buf))) > 0)
+	{
+	  char *cp = buf;
+	  while (cp < buf + n)
+	    {
+	      const struct inotify_event *ev
+		= (const struct inotify_event *) cp;
+	      if ((ev->mask & IN_Q_OVERFLOW)
+		  || (ev->len > 0 && strcmp (ev->name, GAICONF_BASENAME) == 0))
+		changed = true;
+	      cp += sizeof (*ev) + ev->len;
+	    }
+	}
+
+      return changed;
+    }
+
+  gaiconf_ifd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (gaiconf_ifd != -1)
+    {
+      if (inotify_add_watch (gaiconf_ifd, GAICONF_DIR,
+			     IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+			     | IN_MOVED_FROM | IN_MOVED_TO) == -1)
+	{
+	  close_not_cancel_no_status (gaiconf_ifd);
+	  gaiconf_ifd = -1;
+	}
+      else
+	gaiconf_ipid = __getpid ();
+    }
+
+  /* Without a watch, or for changes made before it existed, fall back
+     to the modification time, which is zero while there is no file.  */
+  struct stat64 st;
+  struct timespec mtime = { 0, 0 };
+  if (__xstat64 (_STAT_VER, GAICONF_FNAME, &st) == 0)
+    mtime = st.st_mtim;
+  return memcmp (&mtime, &gaiconf_mtime, sizeof (gaiconf_mtime)) != 0;
 }
 
 
+/* Reload the tables if the file changed.  Called by every lookup while
+   automatic reloading is enabled, but only one thread looks, at most
+   every GAICONF_RECHECK seconds.  Everybody else goes on with the
+   current snapshot.  */
 static void
 gaiconf_reload (void)
 {
-  struct stat64 st;
-  if (__xstat64 (_STAT_VER, GAICONF_FNAME, &st) != 0
-      || memcmp (&st.st_mtim, &gaiconf_mtime, sizeof (gaiconf_mtime)) != 0)
-    gaiconf_init ();
+  time_t now = time (NULL);
+
+  if (now < gaiconf_next_check || __libc_lock_trylock (gaiconf_lock) != 0)
+    return;
+
+  if (now >= gaiconf_next_check)
+    {
+      gaiconf_next_check = now + GAICONF_RECHECK;
+      if (gaiconf_changed ())
+	gaiconf_init ();
+      gaiconf_free_retired (now);
+    }
+
+  __libc_lock_unlock (gaiconf_lock);
 }
 
 
@@ -2243,6 +3845,188 @@ static void flag2len (uint16_t flag, uint16_t *len)
   }
 }
 
+
+/* Outcomes of recent connection attempts, reported by applications
+   through gai_report_connect, per destination prefix: the /24 of an
+   IPv4 address, the NAT64 prefix of a synthesized address or the /64
+   of any other IPv6 address.  The table is direct mapped and updated
+   without a lock; a concurrent report may get lost, which only makes
+   the hint less precise.  */
+struct gai_outcome
+{
+  uint32_t key;			/* gai_outcome_key, 0 if unused.  */
+  uint32_t srtt;		/* Smoothed connect time in ms.  */
+  uint32_t failures;		/* Consecutive failed attempts.  */
+  uint32_t stamp;		/* Time of the last report.  */
+};
+
+#define GAI_OUTCOME_SIZE	64
+/* Reports older than this many seconds are ignored.  */
+#define GAI_OUTCOME_TTL		300
+/* This many consecutive failures make a prefix broken.  */
+#define GAI_OUTCOME_FAILMAX	2
+/* Connect time in ms above which a prefix is slow.  */
+#define GAI_OUTCOME_SLOW	500
+
+static struct gai_outcome gai_outcome[GAI_OUTCOME_SIZE];
+
+/* Incremented whenever a report changes the rank of a prefix, so that
+   cached answers sorted with the old ranks are not used anymore.  Ranks
+   also drop back to 0 when their reports age out, which does not touch
+   this; gai_outcome_lifetime bounds the life of cached answers for
+   that.  */
+static unsigned int gai_outcome_gen;
+
+
+/* Rank of the destinations covered by E: 0 if nothing bad is known,
+   1 if they are slow, 2 if connecting to them keeps failing.  */
+static uint8_t
+gai_outcome_entry_rank (const struct gai_outcome *e, time_t now)
+{
+  if ((uint32_t) now - e->stamp > GAI_OUTCOME_TTL)
+    return 0;
+  if (e->failures >= GAI_OUTCOME_FAILMAX)
+    return 2;
+  if (e->srtt >= GAI_OUTCOME_SLOW)
+    return 1;
+  return 0;
+}
+
+
+/* Seconds from NOW until the first prefix with a nonzero rank ages
+   out, INT32_MAX if there is none.  */
+static int32_t
+gai_outcome_lifetime (time_t now)
+{
+  int32_t left = INT32_MAX;
+
+  for (size_t i = 0; i < GAI_OUTCOME_SIZE; ++i)
+    {
+      const struct gai_outcome *e = &gai_outcome[i];
+
+      if (e->key == 0 || gai_outcome_entry_rank (e, now) == 0)
+	continue;
+      int32_t l = e->stamp + GAI_OUTCOME_TTL + 1 - (uint32_t) now;
+      if (l < left)
+	left = l;
+    }
+
+  return left;
+}
+
+
+/* Hash the prefix of SA.  NAT64PRE/NAT64LEN describe the NAT64 prefix
+   known for SA, if any.  */
+static uint32_t
+gai_outcome_key (const struct sockaddr *sa, const struct in6_addr *nat64pre,
+		 uint16_t nat64len)
+{
+  const unsigned char *cp;
+  size_t len;
+  unsigned char class;
+
+  if (sa->sa_family == AF_INET)
+    {
+      const struct sockaddr_in *sin = (const struct sockaddr_in *) sa;
+      cp = (const unsigned char *) &sin->sin_addr;
+      len = 3;
+      class = 4;
+    }
+  else if (sa->sa_family == AF_INET6)
+    {
+      const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) sa;
+      const struct in6_addr *a = &sin6->sin6_addr;
+
+      if (IN6_IS_ADDR_V4MAPPED (a))
+	{
+	  cp = &a->s6_addr[12];
+	  len = 3;
+	  class = 4;
+	}
+      else if (nat64pre != NULL && nat64len != 0
+	       && memcmp (a, nat64pre, nat64len / 8) == 0)
+	{
+	  cp = a->s6_addr;
+	  len = nat64len / 8;
+	  class = 64;
+	}
+      else
+	{
+	  cp = a->s6_addr;
+	  len = 8;
+	  class = 6;
+	}
+    }
+  else
+    return 0;
+
+  /* FNV-1a.  */
+  uint32_t h = 2166136261u;
+  h = (h ^ class) * 16777619u;
+  while (len-- > 0)
+    h = (h ^ *cp++) * 16777619u;
+
+  return h ?: 1;
+}
+
+
+void
+gai_report_connect (const struct addrinfo *ai, int error, unsigned int msec)
+{
+  if (ai == NULL || ai->ai_addr == NULL)
+    return;
+
+  uint16_t len = 0;
+  if (ai->ai_nat64pre != NULL)
+    flag2len (ai->ai_flags & (AI_SY0 | AI_SY1 | AI_SY2), &len);
+
+  uint32_t key = gai_outcome_key (ai->ai_addr, ai->ai_nat64pre, len);
+  if (key == 0)
+    return;
+
+  struct gai_outcome *e = &gai_outcome[key % GAI_OUTCOME_SIZE];
+  time_t now = time (NULL);
+  uint8_t oldrank = 0;
+  if (e->key != key)
+    {
+      /* Take over the slot.  */
+      e->srtt = 0;
+      e->failures = 0;
+      atomic_write_barrier ();
+      e->key = key;
+    }
+  else
+    oldrank = gai_outcome_entry_rank (e, now);
+
+  if (error != 0)
+    atomic_increment (&e->failures);
+  else
+    {
+      uint32_t srtt = e->srtt;
+      e->srtt = srtt == 0 ? msec : (7 * srtt + msec) / 8;
+      e->failures = 0;
+    }
+  e->stamp = now;
+
+  if (gai_outcome_entry_rank (e, now) != oldrank)
+    atomic_increment (&gai_outcome_gen);
+}
+
+
+/* Classify SA for the connection outcome rule.  */
+static uint8_t
+gai_outcome_rank (const struct sockaddr *sa, const struct in6_addr *nat64pre,
+		  uint16_t nat64len, time_t now)
+{
+  uint32_t key = gai_outcome_key (sa, nat64pre, nat64len);
+  const struct gai_outcome *e = &gai_outcome[key % GAI_OUTCOME_SIZE];
+
+  if (key == 0 || e->key != key)
+    return 0;
+  atomic_read_barrier ();
+  return gai_outcome_entry_rank (e, now);
+}
+
 static int fetch_edns0(const char *name, uint16_t *flag)
 {
 /*
@@ -2322,7 +4106,8 @@ static int heuri_nat64 (const char *v4only_host,
   bool found64 = false;
   unsigned int naddr = 0;
   struct sockaddr_in6 *sock6p = NULL;
-  uint32_t v4n = htonl(v4_addr->sin_addr.s_addr);
+  uint32_t v4n = v4_addr->sin_addr.s_addr;
+  int32_t ttl = INT32_MAX;
 
   struct addrinfo *h = malloc(sizeof(struct addrinfo));
   struct addrinfo *p=NULL;
@@ -2332,7 +4117,7 @@ static int heuri_nat64 (const char *v4only_host,
 
   // query v6 address for v4 only host name
   h->ai_family=AF_INET6;
-  last_i = gaih_inet(v4only_host, NULL, h, end, &naddr);
+  last_i = gaih_inet(v4only_host, NULL, h, end, &naddr, &ttl);
 
   if (last_i != 0)
   {
@@ -2355,21 +4140,678 @@ static int heuri_nat64 (const char *v4only_host,
         }
       }
     }
-    if (found64)
-      break;
+    if (found64)
+      break;
+
+    end=&((*end)->ai_next);
+  } 
+// in6p points to prefix64, 'lp' is for 64_length
+  if(found64)
+  {
+    memset(in6p, '\0', sizeof(struct in6_addr));
+    memcpy(in6p, &(sock6p->sin6_addr), i);
+    *lp= (i*8);
+    return 0;
+  }
+  else
+    return -1;
+}
+
+
+/* fetch_edns0 and heuri_nat64, counted and timed for gai_get_stats.  */
+static int
+fetch_edns0_timed (const char *name, uint16_t *flag)
+{
+  uint64_t start = gai_stage_begin (GAI_STAGE_EDNS0, name);
+  GAI_STAT_INC (nat64_probes);
+  int r = fetch_edns0 (name, flag);
+  gai_stage_end (GAI_STAGE_EDNS0, start, r);
+  return r;
+}
+
+static int
+heuri_nat64_timed (const char *v4only_host, const struct sockaddr_in *v4_addr,
+		   struct in6_addr *in6p, uint16_t *lp)
+{
+  uint64_t start = gai_stage_begin (GAI_STAGE_NAT64, v4only_host);
+  GAI_STAT_INC (nat64_probes);
+  int r = heuri_nat64 (v4only_host, v4_addr, in6p, lp);
+  gai_stage_end (GAI_STAGE_NAT64, start, r);
+  return r;
+}
+
+
+/* NAT64 prefix state shared by all lookups of this process.  */
+struct nat64_state
+{
+  struct in6_addr prefix;
+  uint16_t len;
+  int source;
+  time_t expire;
+  unsigned int gen;		/* Incremented whenever the prefix changes.  */
+};
+
+static struct nat64_state nat64_cur;
+
+/* Odd while nat64_cur is being written, so that nat64_read can read
+   it without taking nat64_lock.  */
+static unsigned int nat64_seq;
+
+/* The descriptor returned by gai_nat64_eventfd is the epoll set
+   nat64_epfd.  It holds nat64_efd, signalled whenever nat64_cur.gen
+   changes, nat64_tfd, which expires with nat64_cur, and ra_fd, so that
+   it also becomes readable when a Router Advertisement is waiting to
+   be picked up.  All of them belong to the process nat64_fd_pid.  */
+static int nat64_epfd = -1;
+static int nat64_efd = -1;
+static int nat64_tfd = -1;
+static pid_t nat64_fd_pid;
+
+__libc_lock_define_initialized (static, nat64_lock);
+
+
+/* Tell gai_nat64_eventfd users that the prefix changed.  Must be
+   called with nat64_lock held, after nat64_write_end, so that they
+   find the new prefix and generation.  */
+static void
+nat64_signal (void)
+{
+  if (nat64_efd != -1 && nat64_fd_pid == __getpid ())
+    eventfd_write (nat64_efd, 1);
+}
+
+
+/* Bracket changes of nat64_cur.  Must be called with nat64_lock
+   held.  */
+static void
+nat64_write_begin (void)
+{
+  ++nat64_seq;
+  atomic_write_barrier ();
+}
+
+static void
+nat64_write_end (void)
+{
+  atomic_write_barrier ();
+  ++nat64_seq;
+}
+
+
+/* RFC 8781 PREF64 option.  */
+#define ND_OPT_PREF64		38
+
+struct nd_opt_pref64
+{
+  uint8_t type;
+  uint8_t len;			/* In units of 8 octets, always 2.  */
+  uint16_t lifetime_plc;	/* Scaled lifetime and prefix length code.  */
+  uint8_t prefix[12];		/* Highest 96 bits of the prefix.  */
+};
+
+/* Prefix lengths indexed by the PLC field.  */
+static const uint16_t pref64_plc_len[] = { 96, 64, 56, 48, 40, 32 };
+
+/* Netlink socket subscribed to the ND user option group, and the
+   process which opened it.  The kernel only queues options which arrive
+   after the subscription, so the socket is kept for the lifetime of the
+   process.  */
+static int ra_fd = -1;
+static pid_t ra_pid;
+
+
+/* Parse the ND options carried in one RTM_NEWNDUSEROPT message and
+   record a PREF64 option.  Must be called with nat64_lock held.  */
+static void
+ra_parse_useropt (const struct nduseroptmsg *ndm, size_t len, time_t now)
+{
+  if (len < sizeof (*ndm) + ndm->nduseropt_opts_len
+      || ndm->nduseropt_family != AF_INET6
+      || ndm->nduseropt_icmp_type != ND_ROUTER_ADVERT
+      || ndm->nduseropt_icmp_code != 0)
+    return;
+
+  const uint8_t *opt = (const uint8_t *) (ndm + 1);
+  const uint8_t *end = opt + ndm->nduseropt_opts_len;
+
+  while (opt + 2 <= end && opt[1] != 0 && opt + opt[1] * 8 <= end)
+    {
+      const struct nd_opt_pref64 *p = (const struct nd_opt_pref64 *) opt;
+
+      if (p->type == ND_OPT_PREF64 && p->len == 2)
+	{
+	  uint16_t lp = ntohs (p->lifetime_plc);
+	  unsigned int plc = lp & 7;
+
+	  if (plc < sizeof (pref64_plc_len) / sizeof (pref64_plc_len[0]))
+	    {
+	      /* The scaled lifetime is in units of 8 seconds, which is
+		 the field value without the PLC bits.  A lifetime of
+		 zero withdraws the prefix.  */
+	      unsigned int lifetime = lp & ~7;
+	      bool changed = (nat64_cur.source != NAT64_SRC_RA
+			      || nat64_cur.len != pref64_plc_len[plc]
+			      || memcmp (&nat64_cur.prefix, p->prefix,
+					 sizeof (p->prefix)) != 0
+			      || lifetime == 0);
+
+	      nat64_write_begin ();
+	      memset (&nat64_cur.prefix, '\0', sizeof (struct in6_addr));
+	      memcpy (&nat64_cur.prefix, p->prefix, sizeof (p->prefix));
+	      nat64_cur.len = pref64_plc_len[plc];
+	      nat64_cur.source = lifetime ? NAT64_SRC_RA : NAT64_SRC_NONE;
+	      nat64_cur.expire = now + lifetime;
+	      if (changed)
+		++nat64_cur.gen;
+	      nat64_write_end ();
+	      if (changed)
+		nat64_signal ();
+	    }
+	}
+
+      opt += opt[1] * 8;
+    }
+}
+
+
+/* Drain the pending RTM_NEWNDUSEROPT notifications.  Must be called
+   with nat64_lock held.  */
+static void
+ra_poll (time_t now)
+{
+  if (ra_fd != -1 && ra_pid != __getpid ())
+    {
+      /* We have been forked; do not steal the parent's notifications.  */
+      close_not_cancel_no_status (ra_fd);
+      ra_fd = -1;
+    }
+
+  if (ra_fd == -1)
+    {
+      struct sockaddr_nl nladdr;
+
+      GAI_STAT_ADD (syscalls, 2);
+      ra_fd = __socket (PF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+			NETLINK_ROUTE);
+      if (ra_fd == -1)
+	return;
+
+      memset (&nladdr, '\0', sizeof (nladdr));
+      nladdr.nl_family = AF_NETLINK;
+      nladdr.nl_groups = 1 << (RTNLGRP_ND_USEROPT - 1);
+      if (__bind (ra_fd, (struct sockaddr *) &nladdr, sizeof (nladdr)) != 0)
+	{
+	  close_not_cancel_no_status (ra_fd);
+	  ra_fd = -1;
+	  return;
+	}
+      ra_pid = __getpid ();
+    }
+
+  char buf[4096];
+  while (1)
+    {
+      struct sockaddr_nl nladdr;
+      socklen_t addrlen = sizeof (nladdr);
+      GAI_STAT_INC (syscalls);
+      ssize_t read_len = TEMP_FAILURE_RETRY (__recvfrom (ra_fd, buf,
+							  sizeof (buf),
+							  MSG_DONTWAIT,
+							  (struct sockaddr *)
+							  &nladdr, &addrlen));
+      if (read_len <= 0)
+	break;
+
+      /* Only the kernel is allowed to tell us about prefixes.  */
+      if (nladdr.nl_pid != 0)
+	continue;
+
+      size_t len = read_len;
+      struct nlmsghdr *nlmh;
+      for (nlmh = (struct nlmsghdr *) buf; NLMSG_OK (nlmh, len);
+	   nlmh = (struct nlmsghdr *) NLMSG_NEXT (nlmh, len))
+	if (nlmh->nlmsg_type == RTM_NEWNDUSEROPT)
+	  ra_parse_useropt ((struct nduseroptmsg *) NLMSG_DATA (nlmh),
+			    NLMSG_PAYLOAD (nlmh, 0), now);
+    }
+}
+
+
+/* Drain the pending Router Advertisements, unless another thread
+   holds nat64_lock; it either does the same or picks them up with its
+   next lookup.  */
+static void
+nat64_poll (time_t now)
+{
+  if (__libc_lock_trylock (nat64_lock) == 0)
+    {
+      ra_poll (now);
+      __libc_lock_unlock (nat64_lock);
+    }
+}
+
+
+/* Copy nat64_cur into *CUR without taking nat64_lock.  The prefix
+   and its generation are always read together.  */
+static void
+nat64_read (struct nat64_state *cur)
+{
+  unsigned int seq;
+
+  do
+    {
+      seq = nat64_seq;
+      atomic_read_barrier ();
+      *cur = nat64_cur;
+      atomic_read_barrier ();
+    }
+  while ((seq & 1) != 0 || seq != nat64_seq);
+}
+
+
+/* Look up the cached NAT64 prefix.  Return the NAT64_SRC_* value it
+   was learned from and the prefix in IN6P/LP, or -1 if nothing valid
+   is cached and discovery has to be done.  If GENP is not NULL, store
+   the generation of the state read there.  */
+static int
+nat64_lookup (struct in6_addr *in6p, uint16_t *lp, unsigned int *genp)
+{
+  struct nat64_state cur;
+  time_t now = time (NULL);
+
+  nat64_poll (now);
+  nat64_read (&cur);
+
+  if (genp != NULL)
+    *genp = cur.gen;
+  if (cur.expire <= now)
+    return -1;
+
+  memcpy (in6p, &cur.prefix, sizeof (struct in6_addr));
+  *lp = cur.len;
+  return cur.source;
+}
+
+
+/* Remember the outcome of DNS based discovery.  A prefix advertised
+   by a router is never replaced by one learned through DNS.  */
+static void
+nat64_store (const struct in6_addr *in6p, uint16_t len, int source)
+{
+  const struct gaiconf_snapshot *conf = gaiconf_cur;
+  time_t now = time (NULL);
+
+  gai_lock (nat64_lock);
+
+  if (nat64_cur.source != NAT64_SRC_RA || nat64_cur.expire <= now)
+    {
+      bool changed = (nat64_cur.source != source || nat64_cur.len != len
+		      || (in6p != NULL
+			  && memcmp (&nat64_cur.prefix, in6p,
+				     sizeof (struct in6_addr)) != 0));
+
+      nat64_write_begin ();
+      if (in6p != NULL)
+	memcpy (&nat64_cur.prefix, in6p, sizeof (struct in6_addr));
+      else
+	memset (&nat64_cur.prefix, '\0', sizeof (struct in6_addr));
+      nat64_cur.len = len;
+      nat64_cur.source = source;
+      nat64_cur.expire = now + (source == NAT64_SRC_NONE
+				? conf->nat64_negative_ttl : conf->nat64_ttl);
+      if (changed)
+	++nat64_cur.gen;
+      nat64_write_end ();
+      if (changed)
+	nat64_signal ();
+    }
+
+  __libc_lock_unlock (nat64_lock);
+}
+
+
+/* The nat64prefix in gai.conf changed.  */
+static void
+nat64_conf_changed (void)
+{
+  gai_lock (nat64_lock);
+  nat64_write_begin ();
+  ++nat64_cur.gen;
+  nat64_write_end ();
+  nat64_signal ();
+  __libc_lock_unlock (nat64_lock);
+}
+
+
+/* Return the current NAT64 prefix generation, after picking up any
+   pending Router Advertisement.  */
+static unsigned int
+nat64_generation (void)
+{
+  struct nat64_state cur;
+
+  nat64_poll (time (NULL));
+  nat64_read (&cur);
+  return cur.gen;
+}
+
+
+/* Per-process cache of complete, sorted answers, used with AI_CACHE.
+   Each entry is one arena holding the key followed by a copy of the
+   answer block (see struct gai_block).  A hit copies the block and
+   relocates its pointers.  */
+#define GAI_CACHE_SIZE		64
+/* Lifetime of answers whose source did not report a TTL, e.g. the
+   files module or nscd, and upper bound for all others.  */
+#define GAI_CACHE_DEFAULT_TTL	30
+#define GAI_CACHE_MAX_TTL	300
+
+/* The block copy in the arena is kept aligned.  */
+#define GAI_CACHE_ALIGN(n) \
+  (((n) + __alignof__ (struct gai_block) - 1)				      \
+   & ~(__alignof__ (struct gai_block) - 1))
+
+struct gai_cache_key
+{
+  int flags;
+  int family;
+  int socktype;
+  int protocol;
+  int maxresults;		/* Limit requested with AI_FIRSTN.  */
+  uint32_t ifgen;		/* Fingerprint of the interface list.  */
+  unsigned int policygen;	/* gaiconf_version.  */
+  unsigned int nat64gen;	/* nat64_cur.gen.  */
+  unsigned int outcomegen;	/* gai_outcome_gen.  */
+  struct in_addr probeaddr;	/* Heuristic probe given in the hints.  */
+  size_t namelen;		/* Including the NUL byte, 0 for NULL.  */
+  size_t servlen;
+  size_t probelen;		/* Probe name, 0 if the hints give none.  */
+  /* NAME, SERVICE and the probe name follow.  */
+};
+
+struct gai_cache_entry
+{
+  uint32_t hash;
+  time_t expire;
+  size_t keylen;
+  size_t headoff;		/* Offset of the first record in the block.  */
+  uintptr_t oldbase;		/* Address of the block which was copied.  */
+  char *arena;
+};
+
+static struct gai_cache_entry gai_cache[GAI_CACHE_SIZE];
+
+__libc_lock_define_initialized (static, gai_cache_lock);
+
+/* Netlink socket subscribed to IPv4 address changes, the process which
+   opened it, and the number of changes seen.  __check_pf only tells
+   whether there are IPv4 addresses at all, but the answers are sorted
+   with their source addresses.  */
+static int gai_cache_v4fd = -1;
+static pid_t gai_cache_v4pid;
+static unsigned int gai_cache_v4gen;
+
+
+libc_freeres_fn(gai_cache_fini)
+{
+  for (size_t i = 0; i < GAI_CACHE_SIZE; ++i)
+    {
+      free (gai_cache[i].arena);
+      gai_cache[i].arena = NULL;
+    }
+
+  if (gai_cache_v4fd != -1)
+    {
+      close_not_cancel_no_status (gai_cache_v4fd);
+      gai_cache_v4fd = -1;
+    }
+}
+
+
+static uint32_t
+gai_cache_hash (const void *p, size_t len, uint32_t h)
+{
+  const unsigned char *cp = p;
+
+  /* FNV-1a.  */
+  while (len-- > 0)
+    h = (h ^ *cp++) * 16777619;
+
+  return h;
+}
+
+
+/* Return the number of IPv4 address changes seen so far.  Must be
+   called with gai_cache_lock held.  */
+static unsigned int
+gai_cache_v4poll (void)
+{
+  if (gai_cache_v4fd != -1 && gai_cache_v4pid != __getpid ())
+    {
+      /* We have been forked; do not steal the parent's notifications.  */
+      close_not_cancel_no_status (gai_cache_v4fd);
+      gai_cache_v4fd = -1;
+    }
+
+  if (gai_cache_v4fd == -1)
+    {
+      struct sockaddr_nl nladdr;
+
+      /* Changes made before the subscription are not known.  Without
+	 one every lookup gets a new generation, so nothing is served
+	 from the cache.  */
+      ++gai_cache_v4gen;
+
+      GAI_STAT_ADD (syscalls, 2);
+      gai_cache_v4fd = __socket (PF_NETLINK,
+				 SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK,
+				 NETLINK_ROUTE);
+      if (gai_cache_v4fd == -1)
+	return gai_cache_v4gen;
+
+      memset (&nladdr, '\0', sizeof (nladdr));
+      nladdr.nl_family = AF_NETLINK;
+      nladdr.nl_groups = RTMGRP_IPV4_IFADDR;
+      if (__bind (gai_cache_v4fd, (struct sockaddr *) &nladdr,
+		  sizeof (nladdr)) != 0)
+	{
+	  close_not_cancel_no_status (gai_cache_v4fd);
+	  gai_cache_v4fd = -1;
+	  return gai_cache_v4gen;
+	}
+      gai_cache_v4pid = __getpid ();
+      return gai_cache_v4gen;
+    }
+
+  /* Any message, or a lost one, is a change.  */
+  char buf[4096];
+  bool changed = false;
+  while (1)
+    {
+      struct sockaddr_nl nladdr;
+      socklen_t addrlen = sizeof (nladdr);
+      GAI_STAT_INC (syscalls);
+      ssize_t read_len = TEMP_FAILURE_RETRY (__recvfrom (gai_cache_v4fd,
+							  buf, sizeof (buf),
+							  MSG_DONTWAIT,
+							  (struct sockaddr *)
+							  &nladdr, &addrlen));
+      if (read_len > 0 || (read_len == -1 && errno == ENOBUFS))
+	changed = true;
+      else
+	break;
+    }
+  if (changed)
+    ++gai_cache_v4gen;
+
+  return gai_cache_v4gen;
+}
+
+
+/* Fingerprint of the interface configuration: what __check_pf returns
+   and the IPv4 address changes seen.  Cached answers are sorted for
+   one set of source addresses and must not survive a change of it.  */
+static uint32_t
+gai_cache_ifgen (bool seen_ipv4, bool seen_ipv6,
+		 const struct in6addrinfo *in6ai, size_t in6ailen)
+{
+  uint32_t h = 2166136261u;
+
+  h = gai_cache_hash (&seen_ipv4, sizeof (seen_ipv4), h);
+  h = gai_cache_hash (&seen_ipv6, sizeof (seen_ipv6), h);
+  if (in6ai != NULL)
+    h = gai_cache_hash (in6ai, in6ailen * sizeof (*in6ai), h);
+
+  gai_lock (gai_cache_lock);
+  unsigned int v4gen = gai_cache_v4poll ();
+  __libc_lock_unlock (gai_cache_lock);
+  h = gai_cache_hash (&v4gen, sizeof (v4gen), h);
+
+  return h;
+}
+
+
+/* Build the lookup key into the buffer at KEYBUF, which must be large
+   enough, and return its length.  */
+static size_t
+gai_cache_mkkey (char *keybuf, const char *name, const char *service,
+		 const struct addrinfo *hints, uint32_t ifgen)
+{
+  struct gai_cache_key *k = (struct gai_cache_key *) keybuf;
+
+  memset (k, '\0', sizeof (*k));
+  k->flags = hints->ai_flags;
+  k->family = hints->ai_family;
+  k->socktype = hints->ai_socktype;
+  k->protocol = hints->ai_protocol;
+  if (hints->ai_flags & AI_FIRSTN)
+    k->maxresults = hints->ai_addrlen;
+  k->ifgen = ifgen;
+  k->policygen = gaiconf_version;
+  k->nat64gen = nat64_generation ();
+  k->outcomegen = gai_outcome_gen;
+  k->namelen = name != NULL ? strlen (name) + 1 : 0;
+  k->servlen = service != NULL ? strlen (service) + 1 : 0;
+  /* The heuristic probes the name and address in the hints instead of
+     the configured ones, which may find another NAT64 prefix.  */
+  if (hints->ai_canonname != NULL && hints->ai_addr != NULL)
+    {
+      k->probeaddr
+	= ((const struct sockaddr_in *) hints->ai_addr)->sin_addr;
+      k->probelen = strlen (hints->ai_canonname) + 1;
+    }
+
+  char *cp = (char *) (k + 1);
+  if (name != NULL)
+    cp = __mempcpy (cp, name, k->namelen);
+  if (service != NULL)
+    cp = __mempcpy (cp, service, k->servlen);
+  if (k->probelen != 0)
+    cp = __mempcpy (cp, hints->ai_canonname, k->probelen);
+
+  return cp - keybuf;
+}
+
+
+/* Move pointer P, which pointed into the block at OLDBASE, into the
+   copy at NEWBASE.  */
+#define GAI_CACHE_RELOC(p, oldbase, newbase) \
+  ((p) == NULL ? NULL							      \
+   : (__typeof (p)) ((char *) (newbase) + ((uintptr_t) (p) - (oldbase))))
+
+
+/* Return a fresh copy of the cached answer for KEY in *PAI, or
+   EAI_NONAME if there is none.  */
+static int
+gai_cache_get (const char *key, size_t keylen, struct addrinfo **pai)
+{
+  uint32_t hash = gai_cache_hash (key, keylen, 2166136261u);
+  struct gai_cache_entry *e = &gai_cache[hash % GAI_CACHE_SIZE];
+  int result = EAI_NONAME;
+
+  gai_lock (gai_cache_lock);
+
+  if (e->arena != NULL && e->hash == hash && e->keylen == keylen
+      && e->expire > time (NULL) && memcmp (e->arena, key, keylen) == 0)
+    {
+      const struct gai_block *src
+	= (const struct gai_block *) (e->arena + GAI_CACHE_ALIGN (keylen));
+      struct gai_block *block = malloc (src->len);
+
+      if (block == NULL)
+	result = EAI_MEMORY;
+      else
+	{
+	  /* The copy starts with the reference count the list had
+	     when it was stored, which is less than nrecords if the
+	     list was truncated.  */
+	  memcpy (block, src, src->len);
+	  for (unsigned int i = 0; i < block->nrecords; ++i)
+	    {
+	      struct addrinfo *ai = &block->records[i].ai;
+
+	      ai->ai_addr = (void *) &block->records[i].addr;
+	      ai->ai_canonname = GAI_CACHE_RELOC (ai->ai_canonname,
+						  e->oldbase, block);
+	      ai->ai_next = GAI_CACHE_RELOC (ai->ai_next, e->oldbase, block);
+	      ai->ai_nat64pre = GAI_CACHE_RELOC (ai->ai_nat64pre,
+						 e->oldbase, block);
+	    }
+
+	  *pai = (struct addrinfo *) ((char *) block + e->headoff);
+	  result = 0;
+	}
+    }
 
-    end=&((*end)->ai_next);
-  } 
-// in6p points to prefix64, 'lp' is for 64_length
-  if(found64)
-  {
-    memset(in6p, '\0', sizeof(struct in6_addr));
-    memcpy(in6p, &(sock6p->sin6_addr), i);
-    *lp= (i*8);
-    return 0;
-  }
-  else
-    return -1;
+  __libc_lock_unlock (gai_cache_lock);
+
+  return result;
+}
+
+
+/* Store the answer AI for KEY.  TTL is the smallest TTL of the
+   records the answer was built from, INT32_MAX if unknown.  */
+static void
+gai_cache_put (const char *key, size_t keylen, const struct addrinfo *ai,
+	       int32_t ttl)
+{
+  time_t now = time (NULL);
+
+  if (ttl == INT32_MAX)
+    ttl = GAI_CACHE_DEFAULT_TTL;
+  else if (ttl > GAI_CACHE_MAX_TTL)
+    ttl = GAI_CACHE_MAX_TTL;
+  /* The answer is sorted with the current connection outcomes.  */
+  int32_t outcomettl = gai_outcome_lifetime (now);
+  if (ttl > outcomettl)
+    ttl = outcomettl;
+  if (ttl <= 0)
+    return;
+
+  const struct gai_block *block = gai_block_of (ai);
+  char *arena = malloc (GAI_CACHE_ALIGN (keylen) + block->len);
+  if (arena == NULL)
+    return;
+
+  memcpy (arena, key, keylen);
+  memcpy (arena + GAI_CACHE_ALIGN (keylen), block, block->len);
+
+  uint32_t hash = gai_cache_hash (key, keylen, 2166136261u);
+  struct gai_cache_entry *e = &gai_cache[hash % GAI_CACHE_SIZE];
+
+  gai_lock (gai_cache_lock);
+
+  char *old = e->arena;
+  e->hash = hash;
+  e->expire = now + ttl;
+  e->keylen = keylen;
+  e->headoff = (const char *) ai - (const char *) block;
+  e->oldbase = (uintptr_t) block;
+  e->arena = arena;
+
+  __libc_lock_unlock (gai_cache_lock);
+
+  free (old);
 }
 
 
@@ -2391,11 +4833,6 @@ getaddrinfo (const char *name, const char *service,
   struct in6_addr prefix64;
   struct sockaddr_in6 *in6p = NULL;
 
-  struct sockaddr_in default_sav4;
-  inet_pton(AF_INET, "127.127.127.127", &(default_sav4.sin_addr));
-  default_sav4.sin_family = AF_INET;
-  char *default_fqdnv4 = "ipv4only.neonsite.net";
-
   if (name != NULL && name[0] == '*' && name[1] == 0)
     name = NULL;
 
@@ -2408,6 +4845,8 @@ getaddrinfo (const char *name, const char *service,
   if (hints == NULL)
     hints = &default_hints;
 
+  GAI_STAT_INC (lookups);
+
   if (hints->ai_flags
       & ~(AI_PASSIVE|AI_CANONNAME|AI_NUMERICHOST|AI_ADDRCONFIG|AI_V4MAPPED
 #ifdef HAVE_LIBIDN
@@ -2416,12 +4855,15 @@ getaddrinfo (const char *name, const char *service,
 #endif
 	  |AI_NUMERICSERV|AI_ALL
 /* new flag for policy table, defined in netdb.h  -- Aaron */
-	  |AI_POLICYTABLE))
+	  |AI_POLICYTABLE|AI_CACHE|AI_FIRSTN))
     return EAI_BADFLAGS;
 
   if ((hints->ai_flags & AI_CANONNAME) && name == NULL)
     return EAI_BADFLAGS;
 
+  if ((hints->ai_flags & AI_FIRSTN) && hints->ai_addrlen == 0)
+    return EAI_BADFLAGS;
+
   struct in6addrinfo *in6ai = NULL;
   size_t in6ailen = 0;
   bool seen_ipv4 = false;
@@ -2430,7 +4872,9 @@ getaddrinfo (const char *name, const char *service,
      Also determine whether we have IPv4 or IPv6 interfaces or both.  We
      cannot cache the results since new interfaces could be added at
      any time.  */
+  uint64_t start = gai_stage_begin (GAI_STAGE_CHECK_PF, name);
   __check_pf (&seen_ipv4, &seen_ipv6, &in6ai, &in6ailen);
+  gai_stage_end (GAI_STAGE_CHECK_PF, start, in6ailen);
 
   if (hints->ai_flags & AI_ADDRCONFIG)
     {
@@ -2476,6 +4920,38 @@ getaddrinfo (const char *name, const char *service,
   else
     pservice = NULL;
 
+  /* Read the config file.  */
+  __libc_once (gaiconf_once, gaiconf_init);
+  if (__builtin_expect (gaiconf_reload_flag_ever_set, 0)
+      && gaiconf_reload_flag)
+    gaiconf_reload ();
+  const struct gaiconf_snapshot *conf = gaiconf_cur;
+  atomic_read_barrier ();
+
+  /* Serve the answer from the per-process cache if possible.  */
+  char *cachekey = NULL;
+  size_t cachekeylen = 0;
+  int32_t ttl = INT32_MAX;
+  if (hints->ai_flags & AI_CACHE)
+    {
+      cachekey = alloca (sizeof (struct gai_cache_key)
+			 + (name != NULL ? strlen (name) + 1 : 0)
+			 + (service != NULL ? strlen (service) + 1 : 0)
+			 + (hints->ai_canonname != NULL
+			    && hints->ai_addr != NULL
+			    ? strlen (hints->ai_canonname) + 1 : 0));
+      cachekeylen = gai_cache_mkkey (cachekey, name, service, hints,
+				     gai_cache_ifgen (seen_ipv4, seen_ipv6,
+						      in6ai, in6ailen));
+      if (gai_cache_get (cachekey, cachekeylen, pai) == 0)
+	{
+	  GAI_STAT_INC (cache_hits);
+	  free (in6ai);
+	  return 0;
+	}
+      GAI_STAT_INC (cache_misses);
+    }
+
   struct addrinfo **end = &p;
 
 // now use gaih_inet to fetch all results
@@ -2483,7 +4959,9 @@ getaddrinfo (const char *name, const char *service,
   if (hints->ai_family == AF_UNSPEC || hints->ai_family == AF_INET
       || hints->ai_family == AF_INET6)
     {
-      last_i = gaih_inet (name, pservice, hints, end, &naddrs);
+      start = gai_stage_begin (GAI_STAGE_INET, name);
+      last_i = gaih_inet (name, pservice, hints, end, &naddrs, &ttl);
+      gai_stage_end (GAI_STAGE_INET, start, -(last_i & GAIH_EAI));
       if (last_i != 0)
 	{
 	  freeaddrinfo (p);
@@ -2523,11 +5001,43 @@ Append prefix length and prefix to answers and deliver to application
     AI_SY bits and ai_nat64pre
 */
 
+/* a prefix learned from the PREF64 option of a Router Advertisement
+  (RFC 8781) needs no DNS query at all, so it takes precedence.
+  Results of DNS discovery are cached process-wide for NAT64_CACHE_TTL
+*/
+
 /* with EDNS0, we obtain WKP and length by checking the AI_SY bits,
   and extract the prefix from the response NAT64-IPv6 address
 */
 
-  if(fetch_edns0(name, &nat_flag) == 0 ) 
+/* a nat64prefix in gai.conf replaces discovery, nat64probe no allows
+  only Router Advertisements
+*/
+
+  int nat64_src;
+
+  if (conf->nat64_len != 0)
+  {
+    memcpy(&prefix64, &conf->nat64_prefix, sizeof(struct in6_addr));
+    pre64len = conf->nat64_len;
+    nat64_src = NAT64_SRC_CONF;
+  }
+  else
+    nat64_src = nat64_lookup (&prefix64, &pre64len, NULL);
+
+  if (nat64_src == NAT64_SRC_RA || nat64_src == NAT64_SRC_DNS
+      || nat64_src == NAT64_SRC_CONF)
+  {
+    find_prefix = true;
+    len2flag(pre64len, &nat_flag);
+  }
+  else if (nat64_src == NAT64_SRC_NONE || !conf->nat64_probe)
+  {
+    /* recently probed, there is no DNS64 on the path */
+    find_prefix = false;
+    nat_flag = 0;
+  }
+  else if(fetch_edns0_timed(name, &nat_flag) == 0 )
     fetch_chk = true;
   else 
   {
@@ -2535,7 +5045,7 @@ Append prefix length and prefix to answers and deliver to application
 
     if (hints != NULL && hints->ai_canonname != NULL && hints->ai_addr != NULL)
     {
-      if ( heuri_nat64(hints->ai_canonname, hints->ai_addr, &prefix64, &pre64len) == 0 )
+      if ( heuri_nat64_timed(hints->ai_canonname, hints->ai_addr, &prefix64, &pre64len) == 0 )
       {
         find_prefix = true;
         len2flag(pre64len, &nat_flag);
@@ -2548,7 +5058,12 @@ Append prefix length and prefix to answers and deliver to application
     }
     else
     {
-      if ( heuri_nat64(default_fqdnv4, &(default_sav4), &prefix64, &pre64len) == 0 )
+      struct sockaddr_in default_sav4;
+      memset(&default_sav4, '\0', sizeof(default_sav4));
+      default_sav4.sin_family = AF_INET;
+      default_sav4.sin_addr = conf->nat64_probe_addr;
+
+      if ( heuri_nat64_timed(conf->nat64_probe_name, &(default_sav4), &prefix64, &pre64len) == 0 )
       {
         find_prefix = true;
         len2flag(pre64len, &nat_flag);
@@ -2559,9 +5074,16 @@ Append prefix length and prefix to answers and deliver to application
         nat_flag = 0;
       }
     }
+
+    if (find_prefix)
+      nat64_store (&prefix64, pre64len, NAT64_SRC_DNS);
+    else
+      nat64_store (NULL, 0, NAT64_SRC_NONE);
   }
 
-  if( (fetch_chk == true) && (naddrs == 1))
+//  find NAT64 prefix in the first synthesized answer
+
+  if(fetch_chk == true)
   {
         if (nat_flag != 0)
         {
@@ -2571,25 +5093,38 @@ Append prefix length and prefix to answers and deliver to application
 
         if (pre64len > 0)
         {
-            if(p->ai_family==AF_INET6)
+          for (struct addrinfo *q = p; q != NULL; q = q->ai_next)
+          {
+            if(q->ai_family==AF_INET6)
             {
-              in6p = (struct sockaddr_in6 *)p->ai_addr;
+              in6p = (struct sockaddr_in6 *)q->ai_addr;
               memset(&prefix64, '\0', sizeof(struct in6_addr));
               memcpy(&prefix64, &(in6p->sin6_addr), (pre64len>>3));
               find_prefix = true;
+              nat64_store (&prefix64, pre64len, NAT64_SRC_DNS);
+              break;
             }
+          }
         }
+
+        /* the SY option came with no prefix length set: the resolver
+           says there is no DNS64, cache that too or every call probes
+           again.  With a length but no AAAA in this result the cache
+           is left alone, a later lookup can learn the prefix.  */
+        if (nat_flag == 0)
+          nat64_store (NULL, 0, NAT64_SRC_NONE);
   }
 
   if (naddrs > 1)
     {
       /* Read the config file.  */
-      __libc_once_define (static, once);
-      __typeof (once) old_once = once;
-      __libc_once (once, gaiconf_init);
       /* Sort results according to RFC 3484.  */
       struct sort_result results[nresults];
       size_t order[nresults];
+      /* Number of entries the caller is going to see.  */
+      int keep = nresults;
+      if ((hints->ai_flags & AI_FIRSTN) && hints->ai_addrlen < nresults)
+	keep = hints->ai_addrlen;
       struct addrinfo *q;
       struct addrinfo *last = NULL;
       char *canonname = NULL;
@@ -2604,10 +5139,20 @@ Append prefix length and prefix to answers and deliver to application
 
 /* p is pointing to the list of address struct */
 
+      for (i = 0, q = p; q != NULL; ++i, q = q->ai_next)
+	results[i].dest_addr = q;
+
+      /* Learn the source addresses of all destinations at once.  */
+      start = gai_stage_begin (GAI_STAGE_SOURCE, name);
+      route_sources (results, nresults);
+
+      time_t now = time (NULL);
       for (i = 0, q = p; q != NULL; ++i, last = q, q = q->ai_next)
 	{
-	  results[i].dest_addr = q;
 	  results[i].native = -1;
+	  results[i].outcome
+	    = gai_outcome_rank (q->ai_addr, find_prefix ? &prefix64 : NULL,
+				pre64len, now);
 	  order[i] = i;
 
 	  /* If we just looked up the address for a different
@@ -2622,34 +5167,35 @@ Append prefix length and prefix to answers and deliver to application
 	      results[i].source_addr_flags = results[i - 1].source_addr_flags;
 	      results[i].prefixlen = results[i - 1].prefixlen;
 	      results[i].index = results[i - 1].index;
+	      continue;
 	    }
-	  else
+
+	  if (!results[i].got_source_addr)
 	    {
-	      results[i].got_source_addr = false;
-	      results[i].source_addr_flags = 0;
-	      results[i].prefixlen = 0;
-	      results[i].index = 0xffffffffu;
-
-	      /* We overwrite the type with SOCK_DGRAM since we do not
-		 want connect() to connect to the other side.  If we
-		 cannot determine the source address remember this
-		 fact.  */
+	      /* The kernel did not tell us.  We overwrite the type with
+		 SOCK_DGRAM since we do not want connect() to connect to
+		 the other side.  If we cannot determine the source
+		 address remember this fact.  */
 	      if (fd == -1 || (af == AF_INET && q->ai_family == AF_INET6))
 		{
 		  if (fd != -1)
 		  close_retry:
 		    close_not_cancel_no_status (fd);
 		  af = q->ai_family;
+		  GAI_STAT_INC (syscalls);
 		  fd = __socket (af, SOCK_DGRAM, IPPROTO_IP);
 		}
 	      else
 		{
 		  /* Reset the connection.  */
 		  struct sockaddr sa = { .sa_family = AF_UNSPEC };
+		  GAI_STAT_INC (syscalls);
 		  __connect (fd, &sa, sizeof (sa));
 		}
 
 	      socklen_t sl = sizeof (results[i].source_addr);
+	      if (fd != -1)
+		GAI_STAT_ADD (syscalls, 2);
 	      if (fd != -1
 		  && __connect (fd, q->ai_addr, q->ai_addrlen) == 0
 		  && __getsockname (fd,
@@ -2659,39 +5205,6 @@ Append prefix length and prefix to answers and deliver to application
 		  results[i].source_addr_len = sl;
 		  results[i].got_source_addr = true;
 
-		  if (in6ai != NULL)
-		    {
-		      /* See whether the source address is on the list of
-			 deprecated or temporary addresses.  */
-		      struct in6addrinfo tmp;
-
-		      if (q->ai_family == AF_INET && af == AF_INET)
-			{
-			  struct sockaddr_in *sinp
-			    = (struct sockaddr_in *) &results[i].source_addr;
-			  tmp.addr[0] = 0;
-			  tmp.addr[1] = 0;
-			  tmp.addr[2] = htonl (0xffff);
-			  tmp.addr[3] = sinp->sin_addr.s_addr;
-			}
-		      else
-			{
-			  struct sockaddr_in6 *sin6p
-			    = (struct sockaddr_in6 *) &results[i].source_addr;
-			  memcpy (tmp.addr, &sin6p->sin6_addr, IN6ADDRSZ);
-			}
-
-		      struct in6addrinfo *found
-			= bsearch (&tmp, in6ai, in6ailen, sizeof (*in6ai),
-				   in6aicmp);
-		      if (found != NULL)
-			{
-			  results[i].source_addr_flags = found->flags;
-			  results[i].prefixlen = found->prefixlen;
-			  results[i].index = found->index;
-			}
-		    }
-
 		  if (q->ai_family == AF_INET && af == AF_INET6)
 		    {
 		      /* We have to convert the address.  The socket is
@@ -2724,131 +5237,134 @@ Append prefix length and prefix to answers and deliver to application
 		results[i].source_addr_len = 0;
 	    }
 
-	  /* Remember the canonical name.  */
-	  if (q->ai_canonname != NULL)
+	  if (results[i].got_source_addr && in6ai != NULL)
 	    {
-	      assert (canonname == NULL);
-	      canonname = q->ai_canonname;
-	      q->ai_canonname = NULL;
+	      /* See whether the source address is on the list of
+		 deprecated or temporary addresses.  */
+	      struct in6addrinfo tmp;
+
+	      if (results[i].source_addr.sin6_family == AF_INET)
+		{
+		  struct sockaddr_in *sinp
+		    = (struct sockaddr_in *) &results[i].source_addr;
+		  tmp.addr[0] = 0;
+		  tmp.addr[1] = 0;
+		  tmp.addr[2] = htonl (0xffff);
+		  tmp.addr[3] = sinp->sin_addr.s_addr;
+		}
+	      else
+		memcpy (tmp.addr, &results[i].source_addr.sin6_addr,
+			IN6ADDRSZ);
+
+	      struct in6addrinfo *found
+		= bsearch (&tmp, in6ai, in6ailen, sizeof (*in6ai),
+			   in6aicmp);
+	      if (found != NULL)
+		{
+		  results[i].source_addr_flags = found->flags;
+		  results[i].prefixlen = found->prefixlen;
+		  results[i].index = found->index;
+		}
 	    }
 	}
 
+      /* Remember the canonical name.  */
+      for (q = p; q != NULL; q = q->ai_next)
+	if (q->ai_canonname != NULL)
+	  {
+	    assert (canonname == NULL);
+	    canonname = q->ai_canonname;
+	    q->ai_canonname = NULL;
+	  }
+
       if (fd != -1)
 	close_not_cancel_no_status (fd);
+      gai_stage_end (GAI_STAGE_SOURCE, start, nresults);
 
       /* We got all the source addresses we can get, now sort using
 	 the information.  */
+      start = gai_stage_begin (GAI_STAGE_SORT, name);
       struct sort_result_combo src
 	= { .results = results, .nresults = nresults };
 
-//  find NAT64 prefix
-
-      if(fetch_chk == true)
-      {
-        if (nat_flag != 0)
-        {
-          flag2len(nat_flag, &pre64len);
-        }
-
-        if (pre64len > 0)
-        {
-          for (i = 0; i < nresults; i++)
-          {
-            if(results[i].dest_addr->ai_family==AF_INET6)
-            {
-              in6p = (struct sockaddr_in6 *)results[i].dest_addr->ai_addr;
-              memset(&prefix64, '\0', sizeof(struct in6_addr));
-              memcpy(&prefix64, &(in6p->sin6_addr), (pre64len>>3));
-              find_prefix = true;
-              break;
-            }
-          }
-        }
-      }
-      
 /*AI_POLICYTABLE check from here,  we reset the values pointed by 'precedence' 
 
 */
+      src.conf = conf;
+
       if((hints->ai_flags)&AI_POLICYTABLE)
       {
-        if(find_prefix)
+        /* Private copies, the tables of the snapshot are shared.  */
+        int s = (sizeof(default_precedence_modify)/sizeof (struct prefixentry));
+        int t = (sizeof(default_labels_modify)/sizeof (struct prefixentry));
+        struct prefixentry precedence_modify[s];
+        struct prefixentry labels_modify[t];
+        struct gaiconf_snapshot policy = *src.conf;
+
+        nat64_policy(precedence_modify, default_precedence_modify, s,
+                     find_prefix ? &prefix64 : NULL, pre64len,
+                     conf->nat64_precedence);
+        policy.precedence = precedence_modify;
+
+        if (conf->nat64_label >= 0)
         {
-          int s = (sizeof(default_precedence_modify)/sizeof (struct prefixentry));
-          memset(&(default_precedence_modify[s-1].prefix), '\0', sizeof(struct in6_addr));
-          memcpy(&(default_precedence_modify[s-1].prefix), &prefix64, sizeof(struct in6_addr));
-          default_precedence_modify[s-1].bits = pre64len;
+          nat64_policy(labels_modify, default_labels_modify, t,
+                       find_prefix ? &prefix64 : NULL, pre64len,
+                       conf->nat64_label);
+          policy.labels = labels_modify;
         }
 
-        precedence = (struct prefixentry *)default_precedence_modify;
-        qsort_r (order, nresults, sizeof (order[0]), rfc3484_sort, &src);
+        src.conf = &policy;
+        rfc3484_select (order, nresults, keep, &src);
       }
       else
-      {
 	/*no AI_POLICY flag, use standard procedure */
-        if (__builtin_expect (gaiconf_reload_flag_ever_set, 0))
-        {
-	      __libc_lock_define_initialized (static, lock);
-
-	      __libc_lock_lock (lock);
-	
-          if (old_once && gaiconf_reload_flag)
-	        gaiconf_reload ();
-	
-          qsort_r (order, nresults, sizeof (order[0]), rfc3484_sort, &src);
-	      __libc_lock_unlock (lock);
-	    }
-        else
-          qsort_r (order, nresults, sizeof (order[0]), rfc3484_sort, &src);
-      }
+        rfc3484_select (order, nresults, keep, &src);
 
 /* end AI_POLICYTABLE*/
+      gai_stage_end (GAI_STAGE_SORT, start, keep);
 
-      /* Queue the results up as they come out of sorting.  */
+      /* Queue the results up as they come out of sorting.  The
+	 entries which did not make it stay in the block but are no
+	 longer part of the list.  */
       q = p = results[order[0]].dest_addr;
-
-      if(find_prefix) 
-      {
-        memset(&p->ai_nat64pre, '\0', sizeof(struct in6_addr));
-        memcpy(&p->ai_nat64pre, &prefix64, sizeof (struct in6_addr));
-      }
-      else
-        memset(&p->ai_nat64pre, '\0', sizeof(struct in6_addr));
-
-      p->ai_flags |= nat_flag;
-
-      for (i = 1; i < nresults; ++i)
-       {
-         q = q->ai_next = results[order[i]].dest_addr;
-         if(find_prefix) 
-         {
-           memset(&q->ai_nat64pre, '\0', sizeof(struct in6_addr));
-           memcpy(&q->ai_nat64pre, &prefix64, sizeof (struct in6_addr));
-         }
-         else
-           memset(&p->ai_nat64pre, '\0', sizeof(struct in6_addr));
-
-         q->ai_flags |= nat_flag;
-       }
+      for (i = 1; i < keep; ++i)
+	q = q->ai_next = results[order[i]].dest_addr;
       q->ai_next = NULL;
+      gai_block_of (p)->refs -= nresults - keep;
 
       /* Fill in the canonical name into the new first entry.  */
       p->ai_canonname = canonname;
 
     }
+  else if ((hints->ai_flags & AI_FIRSTN) && hints->ai_addrlen < nresults)
+    {
+      /* Only one address, nothing to sort; just cut the list.  */
+      struct addrinfo *q = p;
+      for (i = 1; i < hints->ai_addrlen; ++i)
+	q = q->ai_next;
+      q->ai_next = NULL;
+      gai_block_of (p)->refs -= nresults - hints->ai_addrlen;
+    }
 
   free (in6ai);
 
   if (p)
     {
+      /* All records share the prefix stored in their block.  */
+      struct gai_block *block = gai_block_of (p);
+
       if(find_prefix) 
+        memcpy(&block->nat64pre, &prefix64, sizeof (struct in6_addr));
+
+      for (struct addrinfo *q = p; q != NULL; q = q->ai_next)
       {
-           memset(&p->ai_nat64pre, '\0', sizeof(struct in6_addr));
-           memcpy(&p->ai_nat64pre, &prefix64, sizeof (struct in6_addr));
+        q->ai_nat64pre = find_prefix ? &block->nat64pre : NULL;
+        q->ai_flags |= nat_flag;
       }
-      else
-           memset(&p->ai_nat64pre, '\0', sizeof(struct in6_addr));
 
-      p->ai_flags |= nat_flag;
+      if (cachekey != NULL)
+	gai_cache_put (cachekey, cachekeylen, p, ttl);
 
       *pai = p;
       return 0;
@@ -2863,14 +5379,425 @@ static_link_warning (getaddrinfo)
 void
 freeaddrinfo (struct addrinfo *ai)
 {
-  struct addrinfo *p;
-
   while (ai != NULL)
     {
-      p = ai;
+      struct gai_block *block = gai_block_of (ai);
+
       ai = ai->ai_next;
-      free (p->ai_canonname);
-      free (p);
+      if (--block->refs == 0)
+	free (block);
     }
 }
 libc_hidden_def (freeaddrinfo)
+
+
+/* Close the descriptors of gai_nat64_eventfd.  Must be called with
+   nat64_lock held.  */
+static void
+nat64_fd_close (void)
+{
+  if (nat64_epfd != -1)
+    close_not_cancel_no_status (nat64_epfd);
+  if (nat64_efd != -1)
+    close_not_cancel_no_status (nat64_efd);
+  if (nat64_tfd != -1)
+    close_not_cancel_no_status (nat64_tfd);
+  nat64_epfd = nat64_efd = nat64_tfd = -1;
+}
+
+
+/* Clear the descriptor of gai_nat64_eventfd after the prefix has been
+   read, and let it expire with the state just read.  Router
+   Advertisements have been drained by nat64_poll already.  */
+static void
+nat64_fd_rearm (void)
+{
+  gai_lock (nat64_lock);
+  if (nat64_epfd != -1 && nat64_fd_pid == __getpid ())
+    {
+      struct itimerspec its;
+      eventfd_t ev;
+      uint64_t ticks;
+
+      eventfd_read (nat64_efd, &ev);
+      if (read_not_cancel (nat64_tfd, &ticks, sizeof (ticks)) < 0)
+	ticks = 0;
+
+      /* An expired state is not armed again, or the descriptor would
+	 stay readable; it changes with the next discovery.  */
+      memset (&its, '\0', sizeof (its));
+      if (nat64_cur.expire > time (NULL))
+	its.it_value.tv_sec = nat64_cur.expire;
+      timerfd_settime (nat64_tfd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+  __libc_lock_unlock (nat64_lock);
+}
+
+
+int
+gai_nat64_prefix (struct in6_addr *prefix, unsigned int *lenp,
+		  unsigned int *genp)
+{
+  struct in6_addr in6;
+  uint16_t len;
+  const struct gaiconf_snapshot *conf;
+  int src;
+
+  __libc_once (gaiconf_once, gaiconf_init);
+
+  /* A new nat64prefix is published before the generation moves, so
+     read the generation first.  */
+  unsigned int gen = nat64_generation ();
+  atomic_read_barrier ();
+  conf = gaiconf_cur;
+  atomic_read_barrier ();
+
+  if (conf->nat64_len != 0)
+    {
+      memcpy (&in6, &conf->nat64_prefix, sizeof (struct in6_addr));
+      len = conf->nat64_len;
+      src = NAT64_SRC_CONF;
+    }
+  else
+    src = nat64_lookup (&in6, &len, &gen);
+
+  if (src == -1 && conf->nat64_probe)
+    {
+      /* Nothing valid is cached; probe the way getaddrinfo does
+	 without hints.  */
+      struct sockaddr_in sav4;
+
+      memset (&sav4, '\0', sizeof (sav4));
+      sav4.sin_family = AF_INET;
+      sav4.sin_addr = conf->nat64_probe_addr;
+      if (heuri_nat64_timed (conf->nat64_probe_name, &sav4, &in6, &len) == 0)
+	nat64_store (&in6, len, NAT64_SRC_DNS);
+      else
+	nat64_store (NULL, 0, NAT64_SRC_NONE);
+
+      src = nat64_lookup (&in6, &len, &gen);
+    }
+
+  if (genp != NULL)
+    *genp = gen;
+
+  if (nat64_epfd != -1)
+    nat64_fd_rearm ();
+
+  if (src != NAT64_SRC_RA && src != NAT64_SRC_DNS && src != NAT64_SRC_CONF)
+    return EAI_NONAME;
+
+  if (prefix != NULL)
+    memcpy (prefix, &in6, sizeof (struct in6_addr));
+  if (lenp != NULL)
+    *lenp = len;
+  return 0;
+}
+
+
+int
+gai_nat64_eventfd (void)
+{
+  int fd;
+
+  gai_lock (nat64_lock);
+
+  /* The descriptors of the parent are no use after a fork.  */
+  if (nat64_epfd != -1 && nat64_fd_pid != __getpid ())
+    nat64_fd_close ();
+
+  if (nat64_epfd == -1)
+    {
+      struct epoll_event ev = { .events = EPOLLIN };
+
+      /* Open ra_fd.  */
+      ra_poll (time (NULL));
+
+      nat64_epfd = INLINE_SYSCALL (epoll_create1, 1, EPOLL_CLOEXEC);
+      nat64_efd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+      nat64_tfd = timerfd_create (CLOCK_REALTIME,
+				  TFD_NONBLOCK | TFD_CLOEXEC);
+      if (nat64_epfd == -1 || nat64_efd == -1 || nat64_tfd == -1
+	  || INLINE_SYSCALL (epoll_ctl, 4, nat64_epfd, EPOLL_CTL_ADD,
+			     nat64_efd, &ev) != 0
+	  || INLINE_SYSCALL (epoll_ctl, 4, nat64_epfd, EPOLL_CTL_ADD,
+			     nat64_tfd, &ev) != 0
+	  || (ra_fd != -1
+	      && INLINE_SYSCALL (epoll_ctl, 4, nat64_epfd, EPOLL_CTL_ADD,
+				 ra_fd, &ev) != 0))
+	nat64_fd_close ();
+      nat64_fd_pid = __getpid ();
+    }
+  fd = nat64_epfd;
+
+  __libc_lock_unlock (nat64_lock);
+
+  if (fd != -1)
+    nat64_fd_rearm ();
+
+  return fd;
+}
+
+
+/* Delay between the starts of two connection attempts in ms, the
+   Connection Attempt Delay of RFC 8305.  */
+#define GAI_CONNECT_DELAY	250
+
+/* Destinations of one class are interleaved with the other class.  */
+static int
+gai_connect_class (const struct addrinfo *ai)
+{
+  if (ai->ai_family == AF_INET6 && ai->ai_nat64pre != NULL)
+    {
+      uint16_t len;
+      flag2len (ai->ai_flags & (AI_SY0 | AI_SY1 | AI_SY2), &len);
+      const struct sockaddr_in6 *sin6
+	= (const struct sockaddr_in6 *) ai->ai_addr;
+      if (len != 0
+	  && memcmp (&sin6->sin6_addr, ai->ai_nat64pre, len / 8) == 0)
+	/* Synthesized by DNS64; goes through the translator.  */
+	return 1;
+    }
+
+  return ai->ai_family == AF_INET6 ? 0 : 1;
+}
+
+
+/* Monotonic time in ms, so that setting the clock moves neither the
+   attempt delay nor the timeout.  */
+static int64_t
+gai_connect_now (void)
+{
+  struct timespec ts;
+
+  gai_clock_monotonic (&ts);
+  return (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/* Whether an earlier entry than Q of the list at AI has the same
+   socket type and address.  */
+static bool
+gai_connect_dup (const struct addrinfo *ai, const struct addrinfo *q)
+{
+  for (; ai != q; ai = ai->ai_next)
+    if (ai->ai_socktype == q->ai_socktype
+	&& ai->ai_addrlen == q->ai_addrlen
+	&& memcmp (ai->ai_addr, q->ai_addr, q->ai_addrlen) == 0)
+      return true;
+  return false;
+}
+
+
+/* Sockets of gai_connect, closed by gai_connect_cancel if the thread
+   is cancelled while it waits.  */
+struct gai_connect_fds
+{
+  int epfd;
+  int *fds;
+  int n;
+};
+
+static void
+gai_connect_cancel (void *arg)
+{
+  struct gai_connect_fds *c = arg;
+  int i;
+
+  for (i = 0; i < c->n; ++i)
+    if (c->fds[i] != -1)
+      close_not_cancel_no_status (c->fds[i]);
+  close_not_cancel_no_status (c->epfd);
+}
+
+
+int
+gai_connect (const struct addrinfo *ai, int timeout,
+	     const struct addrinfo **usedp)
+{
+  const struct addrinfo *q;
+  int n = 0;
+
+  /* getaddrinfo returns each address once per socket type.  Race
+     only one of them: SOCK_STREAM if there is any, else the type of
+     the first entry.  */
+  int socktype = ai != NULL ? ai->ai_socktype : 0;
+  for (q = ai; q != NULL; q = q->ai_next)
+    if (q->ai_socktype == SOCK_STREAM)
+      {
+	socktype = SOCK_STREAM;
+	break;
+      }
+
+  for (q = ai; q != NULL; q = q->ai_next)
+    if (q->ai_socktype == socktype && !gai_connect_dup (ai, q))
+      ++n;
+  if (n == 0)
+    {
+      __set_errno (EINVAL);
+      return -1;
+    }
+
+  const struct addrinfo *cand[n];
+  n = 0;
+  for (q = ai; q != NULL; q = q->ai_next)
+    if (q->ai_socktype == socktype && !gai_connect_dup (ai, q))
+      cand[n++] = q;
+
+  /* Alternate between native IPv6 and translated or IPv4 destinations,
+     each class in the order getaddrinfo sorted it.  The class of the
+     first entry goes first.  */
+  const struct addrinfo *order[n];
+  int nextq[2] = { 0, 0 };
+  int class = gai_connect_class (cand[0]);
+  int i;
+  for (i = 0; i < n; ++i)
+    {
+      while (nextq[class] < n
+	     && gai_connect_class (cand[nextq[class]]) != class)
+	++nextq[class];
+      if (nextq[class] == n)
+	{
+	  class = !class;
+	  while (gai_connect_class (cand[nextq[class]]) != class)
+	    ++nextq[class];
+	}
+      order[i] = cand[nextq[class]++];
+      class = !class;
+    }
+
+  int epfd = INLINE_SYSCALL (epoll_create1, 1, EPOLL_CLOEXEC);
+  if (epfd == -1)
+    return -1;
+
+  int fds[n];
+  int64_t started[n];
+  for (i = 0; i < n; ++i)
+    fds[i] = -1;
+
+  struct gai_connect_fds cl = { .epfd = epfd, .fds = fds, .n = n };
+  int next = 0;
+  int active = 0;
+  int winner = -1;
+  int error = ETIMEDOUT;
+  int64_t now = gai_connect_now ();
+  int64_t deadline = timeout < 0 ? INT64_MAX : now + timeout;
+  int64_t next_start = now;
+
+  __libc_cleanup_push (gai_connect_cancel, &cl);
+
+  while (winner == -1)
+    {
+      if (next < n && now >= next_start)
+	{
+	  /* Start the next attempt.  */
+	  q = order[next];
+	  started[next] = now;
+	  fds[next] = __socket (q->ai_family,
+				q->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				q->ai_protocol);
+	  if (fds[next] != -1)
+	    {
+	      if (__connect (fds[next], q->ai_addr, q->ai_addrlen) == 0)
+		{
+		  winner = next++;
+		  break;
+		}
+	      if (errno == EINPROGRESS)
+		{
+		  struct epoll_event ev = { .events = EPOLLOUT,
+					    .data.u32 = next };
+		  if (INLINE_SYSCALL (epoll_ctl, 4, epfd, EPOLL_CTL_ADD,
+				      fds[next], &ev) == 0)
+		    {
+		      ++active;
+		      next_start = now + GAI_CONNECT_DELAY;
+		      ++next;
+		      continue;
+		    }
+		}
+	      error = errno;
+	      gai_report_connect (q, error, 0);
+	      close_not_cancel_no_status (fds[next]);
+	      fds[next] = -1;
+	    }
+	  else
+	    error = errno;
+	  /* Failed right away; go on with the next one now.  */
+	  ++next;
+	  continue;
+	}
+
+      if (active == 0 && next == n)
+	break;
+      if (now >= deadline)
+	{
+	  error = ETIMEDOUT;
+	  break;
+	}
+
+      int64_t wait = deadline - now;
+      if (next < n && next_start - now < wait)
+	wait = next_start - now;
+      if (wait > INT_MAX)
+	wait = INT_MAX;
+
+      /* A cancellation point; gai_connect_cancel closes the sockets.  */
+      struct epoll_event evs[8];
+      int nev = epoll_wait (epfd, evs, 8, wait);
+      if (nev == -1 && errno != EINTR)
+	{
+	  error = errno;
+	  break;
+	}
+      now = gai_connect_now ();
+
+      for (int e = 0; e < nev && winner == -1; ++e)
+	{
+	  int idx = evs[e].data.u32;
+	  int soerr = 0;
+	  socklen_t sl = sizeof (soerr);
+
+	  if (__getsockopt (fds[idx], SOL_SOCKET, SO_ERROR, &soerr, &sl) != 0)
+	    soerr = errno;
+	  if (soerr == 0)
+	    {
+	      winner = idx;
+	      break;
+	    }
+
+	  error = soerr;
+	  gai_report_connect (order[idx], soerr, now - started[idx]);
+	  close_not_cancel_no_status (fds[idx]);
+	  fds[idx] = -1;
+	  --active;
+	  /* Do not wait for the delay after a failure.  */
+	  next_start = now;
+	}
+    }
+
+  __libc_cleanup_pop (0);
+
+  close_not_cancel_no_status (epfd);
+
+  /* Give up on everything which is still pending.  */
+  for (i = 0; i < next; ++i)
+    if (i != winner && fds[i] != -1)
+      close_not_cancel_no_status (fds[i]);
+
+  if (winner == -1)
+    {
+      __set_errno (error);
+      return -1;
+    }
+
+  gai_report_connect (order[winner], 0, now - started[winner]);
+
+  int fl = __fcntl (fds[winner], F_GETFL);
+  if (fl != -1)
+    __fcntl (fds[winner], F_SETFL, fl & ~O_NONBLOCK);
+
+  if (usedp != NULL)
+    *usedp = order[winner];
+  return fds[winner];
+}
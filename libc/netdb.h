@@ -575,7 +575,8 @@ struct addrinfo
   char *ai_canonname;		/* Canonical name for service location.  */
   struct addrinfo *ai_next;	/* Pointer to next in list.  */
 
-/* new adding, NAT64 prefix, network byte order */
+/* new adding, NAT64 prefix, network byte order.  Points into storage
+   owned by the result list, NULL if no prefix is known.  */
   struct in6_addr *ai_nat64pre;
 };
 
@@ -611,6 +612,10 @@ Aaron 02.01.2011
 */
 
 # define AI_POLICYTABLE 0x1000 /* Use the modified policy table  */
+# define AI_CACHE	0x0800	/* Answer may come from, and is stored in,
+				   the per-process lookup cache.  */
+# define AI_FIRSTN	0x10000	/* Return at most hints->ai_addrlen
+				   results, the best ones first.  */
 
 # define AI_SY0 0x8000
 # define AI_SY1 0x4000
@@ -722,6 +727,74 @@ extern int gai_error (struct gaicb *__req) __THROW;
 
 /* Cancel the requests associated with GAICBP.  */
 extern int gai_cancel (struct gaicb *__gaicbp) __THROW;
+
+/* Report how connecting to AI, an entry of a list returned by
+   getaddrinfo, went: ERROR is zero on success or the errno value of
+   the failure, MSEC the time the attempt took.  getaddrinfo ranks
+   destinations behind slow or failing prefixes lower.  */
+extern void gai_report_connect (__const struct addrinfo *__ai, int __error,
+				unsigned int __msec) __THROW;
+
+/* Connect to one of the entries of AI, a list returned by getaddrinfo,
+   racing the attempts as described in RFC 8305: a new attempt is
+   started every 250 ms, alternating between native IPv6 and NAT64 or
+   IPv4 destinations.  Return the connected, blocking socket and store
+   the entry used in *USEDP, or return -1 and set errno if nothing
+   connected within TIMEOUT ms (no limit if negative).
+
+   This function is a possible cancellation point and therefore not
+   marked with __THROW.  */
+extern int gai_connect (__const struct addrinfo *__ai, int __timeout,
+			__const struct addrinfo **__usedp);
+
+/* Store the NAT64 prefix used by getaddrinfo in *PREFIX and its length
+   in bits in *LENP, probing for it if nothing is known.  *GENP is set
+   to a number which changes whenever the prefix changes.  Return zero
+   on success or EAI_NONAME if there is no NAT64 on the path.  */
+extern int gai_nat64_prefix (struct in6_addr *__prefix, unsigned int *__lenp,
+			     unsigned int *__genp) __THROW;
+
+/* Return a descriptor which becomes readable when the NAT64 prefix
+   may have changed, or -1.  Call gai_nat64_prefix then, which clears
+   it.  It is shared by the process and must not be read or closed;
+   after fork the child has to ask for its own.  */
+extern int gai_nat64_eventfd (void) __THROW;
+
+/* Stages of getaddrinfo which are timed in struct gai_stats.  */
+enum
+{
+  GAI_STAGE_CHECK_PF,		/* Interface lookup (__check_pf).  */
+  GAI_STAGE_INET,		/* Name and service lookup.  */
+  GAI_STAGE_EDNS0,		/* Query for the DNS64 EDNS0 option.  */
+  GAI_STAGE_NAT64,		/* NAT64 prefix probe.  */
+  GAI_STAGE_SOURCE,		/* Source address selection.  */
+  GAI_STAGE_SORT,		/* Destination address sorting.  */
+  GAI_STAGE_MAX
+};
+
+/* Bucket I of a histogram counts durations of less than 2^I
+   microseconds which do not fit into bucket I - 1; the last bucket
+   counts everything longer.  */
+# define GAI_STATS_BUCKETS	24
+
+/* Process-wide counters of getaddrinfo.  */
+struct gai_stats
+{
+  unsigned long int lookups;	/* Calls of getaddrinfo.  */
+  unsigned long int cache_hits;	/* AI_CACHE lookups answered...  */
+  unsigned long int cache_misses; /* ...and not answered by the cache.  */
+  unsigned long int nat64_probes; /* DNS queries to find the NAT64 prefix.  */
+  unsigned long int syscalls;	/* Socket calls for source selection and
+				   Router Advertisements.  */
+  unsigned long int lock_waits;	/* Times a thread waited for a lock.  */
+  unsigned long int stage_calls[GAI_STAGE_MAX];
+  unsigned long int stage_usec[GAI_STAGE_MAX];
+  unsigned long int stage_hist[GAI_STAGE_MAX][GAI_STATS_BUCKETS];
+};
+
+/* Copy the counters of getaddrinfo to *STATS.  They are updated
+   without a lock, so a lookup in progress may be partially counted.  */
+extern void gai_get_stats (struct gai_stats *__stats) __THROW;
 #endif	/* GNU */
 
 __END_DECLS
@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# Loopback testbed for the patched libc and named, see README.md.
+#
+#   testbed.sh setup [NAMED]	create the nat64 namespace and start NAMED
+#				(default: named from $PATH) in it
+#   testbed.sh teardown		stop named and remove the namespace
+#
+# Needs root.  named runs in $RUN (default /tmp/nat64-testbed) and logs
+# to named.run there.
+
+set -e
+
+NS=nat64
+PREFIX=64:ff9b::/96
+HERE=$(cd "$(dirname "$0")" && pwd)
+RUN=${RUN:-/tmp/nat64-testbed}
+
+setup()
+{
+	named=${1:-named}
+
+	ip netns add $NS
+	ip -n $NS link set lo up
+	# Fake translator and servers: every address in the NAT64 prefix
+	# and in the networks of test.zone is local.
+	ip -n $NS route add local $PREFIX dev lo
+	ip -n $NS route add local 2001:db8::/64 dev lo
+	ip -n $NS route add local 192.0.2.0/24 dev lo
+
+	# ip netns exec mounts these over /etc/resolv.conf and
+	# /etc/gai.conf.
+	mkdir -p /etc/netns/$NS
+	echo 'nameserver ::1' > /etc/netns/$NS/resolv.conf
+	echo 'nat64probe ipv4only.arpa 192.0.0.170' > /etc/netns/$NS/gai.conf
+
+	mkdir -p "$RUN"
+	cp "$HERE"/named.conf "$HERE"/*.zone "$RUN"
+	(cd "$RUN" && ip netns exec $NS "$named" -c named.conf -d 3)
+}
+
+teardown()
+{
+	if [ -f "$RUN"/named.pid ]; then
+		kill "$(cat "$RUN"/named.pid)" 2>/dev/null || :
+	fi
+	ip netns del $NS 2>/dev/null || :
+	rm -rf /etc/netns/$NS "$RUN"
+}
+
+case "$1" in
+setup)
+	shift
+	setup "$@"
+	;;
+teardown)
+	teardown
+	;;
+*)
+	echo "usage: $0 setup [named] | teardown" >&2
+	exit 1
+	;;
+esac